@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "affinity.h"
+#include "print.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Parses a comma separated list of CPU numbers and ranges.
+ * Returns false if the list is not valid.
+ */
+bool
+affinity_parse (const char *str, cpu_list_t *list)
+{
+	const char *p = str;
+
+	list->cpus = NULL;
+	list->count = 0;
+
+	while (*p != '\0') {
+		char *end;
+		long first, last;
+
+		first = last = strtol (p, &end, 10);
+		if (end == p || first < 0)
+			goto error;
+		p = end;
+
+		if (*p == '-') {
+			last = strtol (++p, &end, 10);
+			if (end == p || last < first)
+				goto error;
+			p = end;
+		}
+
+		if (last >= CPU_SETSIZE)
+			goto error;
+
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			goto error;
+		}
+
+		list->cpus = realloc (list->cpus, (list->count + last - first + 1) * sizeof (int));
+		for (long cpu = first; cpu <= last; cpu++)
+			list->cpus[list->count++] = cpu;
+	}
+
+	if (list->count > 0)
+		return true;
+
+error:
+	free (list->cpus);
+	list->cpus = NULL;
+	list->count = 0;
+	return false;
+}
+
+/* Set once a failure to pin has been reported, so each thread does not
+ * report it again
+ */
+static atomic_flag pin_warned = ATOMIC_FLAG_INIT;
+
+static bool
+pin (cpu_set_t *set)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	int err = pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), set);
+
+	if (err != 0) {
+		if (!atomic_flag_test_and_set (&pin_warned))
+			print_error ("Could not set the CPU affinity, running unpinned - %s\n",
+					strerror (err));
+		return false;
+	}
+
+	return true;
+#else
+	if (!atomic_flag_test_and_set (&pin_warned))
+		print_error ("CPU pinning is not supported on this system\n");
+
+	return false;
+#endif
+}
+
+/* Lets the calling thread run on any of the CPUs in the list */
+bool
+affinity_pin_all (const cpu_list_t *list)
+{
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	for (int i = 0; i < list->count; i++)
+		CPU_SET (list->cpus[i], &set);
+
+	return pin (&set);
+}
+
+/* Pins the calling thread to a single CPU from the list, picked by index.
+ * Threads with consecutive indexes get consecutive CPUs.
+ */
+bool
+affinity_pin_index (const cpu_list_t *list, int index)
+{
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (list->cpus[index % list->count], &set);
+
+	return pin (&set);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <stdbool.h>
+
+/* A list of CPUs, as given on the command line (e.g. "0-3,8") */
+typedef struct {
+	int *cpus;
+	int count;
+} cpu_list_t;
+
+bool affinity_parse     (const char *str, cpu_list_t *list);
+bool affinity_pin_all   (const cpu_list_t *list);
+bool affinity_pin_index (const cpu_list_t *list, int index);
+
+#endif /* _AFFINITY_H_ */
@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asf.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define GUID_LEN           16
+#define OBJECT_HEADER_LEN  (GUID_LEN + 8)
+#define HEADER_OBJECT_LEN  (OBJECT_HEADER_LEN + 6)
+#define DATA_OBJECT_LEN    (OBJECT_HEADER_LEN + GUID_LEN + 8 + 2)
+
+static const uint8_t guid_header[GUID_LEN] = {
+	0x30, 0x26, 0xb2, 0x75, 0x8e, 0x66, 0xcf, 0x11,
+	0xa6, 0xd9, 0x00, 0xaa, 0x00, 0x62, 0xce, 0x6c
+};
+
+static const uint8_t guid_file_properties[GUID_LEN] = {
+	0xa1, 0xdc, 0xab, 0x8c, 0x47, 0xa9, 0xcf, 0x11,
+	0x8e, 0xe4, 0x00, 0xc0, 0x0c, 0x20, 0x53, 0x65
+};
+
+static const uint8_t guid_data[GUID_LEN] = {
+	0x36, 0x26, 0xb2, 0x75, 0x8e, 0x66, 0xcf, 0x11,
+	0xa6, 0xd9, 0x00, 0xaa, 0x00, 0x62, 0xce, 0x6c
+};
+
+static const uint8_t guid_simple_index[GUID_LEN] = {
+	0x90, 0x08, 0x00, 0x33, 0xb1, 0xe5, 0xcf, 0x11,
+	0x89, 0xf4, 0x00, 0xa0, 0xc9, 0x03, 0x49, 0xcb
+};
+
+/* Length of the simple index object without entries, and of each entry */
+#define SIMPLE_INDEX_LEN       (OBJECT_HEADER_LEN + GUID_LEN + 8 + 4 + 4)
+#define SIMPLE_INDEX_ENTRY_LEN 6
+
+/* Time between index entries, in milliseconds */
+#define INDEX_INTERVAL 1000
+
+static uint32_t
+get_le32 (const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+get_le64 (const uint8_t *p)
+{
+	return get_le32 (p) | (uint64_t)get_le32 (p + 4) << 32;
+}
+
+static void
+put_le16 (uint8_t *p, uint16_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static void
+put_le32 (uint8_t *p, uint32_t val)
+{
+	put_le16 (p, val);
+	put_le16 (p + 2, val >> 16);
+}
+
+static void
+put_le64 (uint8_t *p, uint64_t val)
+{
+	put_le32 (p, val);
+	put_le32 (p + 4, val >> 32);
+}
+
+/* Returns the size of a field with the given length type */
+static uint32_t
+field_len (int type)
+{
+	static const uint32_t lens[4] = { 0, 1, 2, 4 };
+
+	return lens[type & 3];
+}
+
+/* Parses the ASF header as returned by mmsx_peek_header (the header object
+ * followed by the data object header).
+ * Returns false if the header is not valid.
+ */
+bool
+asf_header_parse (const char *data, uint32_t len, asf_header_t *header)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t header_size;
+	bool have_props = false;
+
+	if (len < HEADER_OBJECT_LEN || memcmp (p, guid_header, GUID_LEN))
+		return false;
+
+	header_size = get_le64 (p + GUID_LEN);
+
+	if (header_size < HEADER_OBJECT_LEN || header_size + DATA_OBJECT_LEN > len)
+		return false;
+
+	/* Look for the file properties object */
+	for (uint64_t off = HEADER_OBJECT_LEN; off + OBJECT_HEADER_LEN <= header_size; ) {
+		uint64_t size = get_le64 (p + off + GUID_LEN);
+
+		if (size < OBJECT_HEADER_LEN || off + size > header_size)
+			return false;
+
+		if (!memcmp (p + off, guid_file_properties, GUID_LEN) && size >= 104) {
+			memcpy (header->file_id, p + off + 24, GUID_LEN);
+			header->packet_count = get_le64 (p + off + 56);
+			header->packet_len   = get_le32 (p + off + 92);
+
+			/* Only fixed size packets are supported */
+			if (header->packet_len != get_le32 (p + off + 96))
+				return false;
+
+			have_props = true;
+		}
+
+		off += size;
+	}
+
+	if (!have_props || memcmp (p + header_size, guid_data, GUID_LEN))
+		return false;
+
+	header->data_offset = header_size + DATA_OBJECT_LEN;
+
+	return header->packet_len > 0;
+}
+
+/* Returns the offset of the file properties object in a parsed header */
+static uint64_t
+file_properties (const uint8_t *p, uint64_t header_size)
+{
+	for (uint64_t off = HEADER_OBJECT_LEN; off + OBJECT_HEADER_LEN <= header_size; ) {
+		uint64_t size = get_le64 (p + off + GUID_LEN);
+
+		if (size < OBJECT_HEADER_LEN)
+			break;
+
+		if (!memcmp (p + off, guid_file_properties, GUID_LEN) && size >= 104)
+			return off;
+
+		off += size;
+	}
+
+	return 0;
+}
+
+/* Updates the sizes and packet counts in a parsed header, so it describes a
+ * file holding packet_count data packets. Used when a live stream is split
+ * into several files.
+ * Returns false if the header is not valid.
+ */
+bool
+asf_header_set_packets (char *data, uint32_t len, uint64_t packet_count)
+{
+	uint8_t *p = (uint8_t *)data;
+	asf_header_t header;
+	uint64_t header_size, data_size, off;
+
+	if (!asf_header_parse (data, len, &header))
+		return false;
+
+	header_size = get_le64 (p + GUID_LEN);
+	data_size   = DATA_OBJECT_LEN + packet_count * header.packet_len;
+
+	if (!(off = file_properties (p, header_size)))
+		return false;
+
+	put_le64 (p + off + 40, header_size + data_size);
+	put_le64 (p + off + 56, packet_count);
+
+	put_le64 (p + header_size + GUID_LEN, data_size);
+	put_le64 (p + header_size + OBJECT_HEADER_LEN + GUID_LEN, packet_count);
+
+	return true;
+}
+
+/* Updates the file size in a parsed header, for when objects are added
+ * after the data.
+ * Returns false if the header is not valid.
+ */
+bool
+asf_header_set_size (char *data, uint32_t len, uint64_t file_size)
+{
+	uint8_t *p = (uint8_t *)data;
+	asf_header_t header;
+	uint64_t off;
+
+	if (!asf_header_parse (data, len, &header))
+		return false;
+
+	if (!(off = file_properties (p, get_le64 (p + GUID_LEN))))
+		return false;
+
+	put_le64 (p + off + 40, file_size);
+
+	return true;
+}
+
+/* Does a sanity check on the start of an ASF data packet.
+ * Returns false if the data can not be the start of a packet.
+ */
+bool
+asf_packet_check (const char *data, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	if (len < 1)
+		return true;
+
+	/* Error correction data, which must be two bytes of unknown type */
+	if (p[0] & 0x80) {
+		if ((p[0] & 0x7f) != 0x02)
+			return false;
+
+		if (len < 5)
+			return true;
+
+		p += 3;
+	} else if (len < 2) {
+		return true;
+	}
+
+	/* The error correction bit in the length type flags must be clear,
+	 * and the stream number length type must be BYTE.
+	 */
+	return !(p[0] & 0x80) && (p[1] & 0xc0) == 0x40;
+}
+
+/* Reads the send time from the start of an ASF data packet.
+ * Returns false if len is too short or the packet is not valid.
+ */
+bool
+asf_packet_time (const char *data, uint32_t len, uint32_t *send_time)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t pos = 0;
+	uint8_t flags;
+
+	if (!asf_packet_check (data, len) || len < 1)
+		return false;
+
+	if (p[0] & 0x80)
+		pos += 1 + (p[0] & 0x0f);
+
+	if (pos + 2 > len)
+		return false;
+
+	flags = p[pos];
+	pos += 2;
+
+	/* Skip the packet length, sequence and padding length fields */
+	pos += field_len (flags >> 5) + field_len (flags >> 1) + field_len (flags >> 3);
+
+	if (pos + 6 > len)
+		return false;
+
+	*send_time = get_le32 (p + pos);
+
+	return true;
+}
+
+/* Sets up an index for a stream of len bytes with the given header.
+ * Returns false if the stream does not consist of whole packets.
+ */
+bool
+asf_index_init (asf_index_t *index, const asf_header_t *header, uint32_t len)
+{
+	if (len < header->data_offset ||
+	    (len - header->data_offset) % header->packet_len != 0)
+		return false;
+
+	memcpy (index->file_id, header->file_id, GUID_LEN);
+	index->data_offset  = header->data_offset;
+	index->packet_len   = header->packet_len;
+	index->packet_count = (len - header->data_offset) / header->packet_len;
+	index->send_times   = malloc (index->packet_count * sizeof (uint32_t));
+
+	if (index->send_times == NULL)
+		return false;
+
+	for (uint32_t i = 0; i < index->packet_count; i++)
+		index->send_times[i] = ASF_TIME_UNKNOWN;
+
+	return true;
+}
+
+/* Records the send time of every packet that starts in the given data.
+ * Packets whose header is split between two buffers are left unknown, and
+ * must be filled in with asf_index_set.
+ */
+void
+asf_index_add (asf_index_t *index, uint32_t off, const char *data, uint32_t len)
+{
+	uint32_t end = off + len;
+	uint32_t packet;
+
+	if (end <= index->data_offset)
+		return;
+
+	if (off <= index->data_offset) {
+		packet = 0;
+	} else {
+		packet = (off - index->data_offset + index->packet_len - 1) / index->packet_len;
+	}
+
+	for (; packet < index->packet_count; packet++) {
+		uint32_t start = index->data_offset + packet * index->packet_len;
+		uint32_t send_time;
+
+		if (start >= end)
+			break;
+
+		if (asf_packet_time (data + (start - off), end - start, &send_time))
+			index->send_times[packet] = send_time;
+	}
+}
+
+/* Finds the next packet from packet and onwards without a send time.
+ * Returns false if there are none, otherwise sets packet and off.
+ */
+bool
+asf_index_missing (asf_index_t *index, uint32_t *packet, uint32_t *off)
+{
+	for (; *packet < index->packet_count; (*packet)++) {
+		if (index->send_times[*packet] == ASF_TIME_UNKNOWN) {
+			*off = index->data_offset + *packet * index->packet_len;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+asf_index_set (asf_index_t *index, uint32_t packet, uint32_t send_time)
+{
+	if (packet < index->packet_count)
+		index->send_times[packet] = send_time;
+}
+
+/* Builds a simple index object, with one entry per second pointing to the
+ * last packet sent before that time. Packets without a send time are
+ * skipped. Returns the object, which must be freed, and its size in len.
+ */
+char *
+asf_index_build (asf_index_t *index, uint32_t *len)
+{
+	uint32_t last_time = 0, entry_count = 0;
+	uint32_t packet = 0;
+	uint8_t *obj, *entry;
+
+	for (uint32_t i = 0; i < index->packet_count; i++) {
+		if (index->send_times[i] != ASF_TIME_UNKNOWN &&
+		    index->send_times[i] > last_time)
+			last_time = index->send_times[i];
+	}
+
+	entry_count = last_time / INDEX_INTERVAL + 1;
+	*len = SIMPLE_INDEX_LEN + entry_count * SIMPLE_INDEX_ENTRY_LEN;
+
+	if (!(obj = malloc (*len)))
+		return NULL;
+
+	memcpy (obj, guid_simple_index, GUID_LEN);
+	put_le64 (obj + GUID_LEN, *len);
+	memcpy (obj + OBJECT_HEADER_LEN, index->file_id, GUID_LEN);
+	/* The entry time interval is in 100-nanosecond units */
+	put_le64 (obj + OBJECT_HEADER_LEN + GUID_LEN, INDEX_INTERVAL * 10000ULL);
+	put_le32 (obj + OBJECT_HEADER_LEN + GUID_LEN + 8, 1);
+	put_le32 (obj + OBJECT_HEADER_LEN + GUID_LEN + 12, entry_count);
+
+	entry = obj + SIMPLE_INDEX_LEN;
+	for (uint32_t i = 0; i < entry_count; i++) {
+		uint64_t time = (uint64_t)i * INDEX_INTERVAL;
+
+		while (packet + 1 < index->packet_count &&
+		       (index->send_times[packet + 1] == ASF_TIME_UNKNOWN ||
+		        index->send_times[packet + 1] <= time))
+			packet++;
+
+		put_le32 (entry, packet);
+		put_le16 (entry + 4, 1);
+		entry += SIMPLE_INDEX_ENTRY_LEN;
+	}
+
+	return (char *)obj;
+}
+
+void
+asf_index_free (asf_index_t *index)
+{
+	free (index->send_times);
+	index->send_times = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ASF_H_
+#define _ASF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The parts of an ASF header mmsget cares about */
+typedef struct {
+	uint8_t  file_id[16];
+	uint64_t packet_count;
+	uint32_t packet_len;
+
+	/* Offset of the first data packet, the size of the header object
+	 * plus the data object header.
+	 */
+	uint32_t data_offset;
+} asf_header_t;
+
+/* Maximum size of the fields at the start of a data packet, up to and
+ * including the send time and duration.
+ */
+#define ASF_PACKET_HEADER_MAX 23
+
+/* Simple index built from the send times of the data packets */
+typedef struct {
+	uint8_t  file_id[16];
+	uint32_t data_offset;
+	uint32_t packet_len;
+	uint32_t packet_count;
+
+	/* Send time in milliseconds of each packet, or ASF_TIME_UNKNOWN */
+	uint32_t *send_times;
+} asf_index_t;
+
+#define ASF_TIME_UNKNOWN UINT32_MAX
+
+bool asf_header_parse  (const char *data, uint32_t len, asf_header_t *header);
+bool asf_header_set_packets (char *data, uint32_t len, uint64_t packet_count);
+bool asf_header_set_size (char *data, uint32_t len, uint64_t file_size);
+bool asf_packet_check  (const char *data, uint32_t len);
+bool asf_packet_time   (const char *data, uint32_t len, uint32_t *send_time);
+
+bool asf_index_init    (asf_index_t *index, const asf_header_t *header, uint32_t len);
+void asf_index_add     (asf_index_t *index, uint32_t off, const char *data, uint32_t len);
+bool asf_index_missing (asf_index_t *index, uint32_t *packet, uint32_t *off);
+void asf_index_set     (asf_index_t *index, uint32_t packet, uint32_t send_time);
+char *asf_index_build  (asf_index_t *index, uint32_t *len);
+void asf_index_free    (asf_index_t *index);
+
+#endif /* _ASF_H_ */
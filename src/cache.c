@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "cache.h"
+#include "checksum.h"
+#include "print.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define COPY_BUF_SIZE (64 * 1024)
+
+/* Returns a 64 bit FNV-1a hash of data */
+static uint64_t
+fnv1a (const char *data, uint32_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (uint32_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static char *
+cache_path (const char *dir, const char *key, const char *ext)
+{
+	char *path = malloc (strlen (dir) + strlen (key) + strlen (ext) + 2);
+
+	sprintf (path, "%s/%s%s", dir, key, ext);
+
+	return path;
+}
+
+/* Adds a range to the list, merging it with the ranges it touches */
+static void
+add_range (cache_t *cache, uint32_t start, uint32_t end)
+{
+	int i, j;
+
+	if (start >= end)
+		return;
+
+	/* Find the first range that ends at or after start */
+	for (i = 0; i < cache->range_count && cache->ranges[i].end < start; i++);
+
+	/* Find the ranges that overlap or touch the new one */
+	for (j = i; j < cache->range_count && cache->ranges[j].start <= end; j++) {
+		if (cache->ranges[j].start < start)
+			start = cache->ranges[j].start;
+		if (cache->ranges[j].end > end)
+			end = cache->ranges[j].end;
+	}
+
+	if (i == j) {
+		cache->ranges = realloc (cache->ranges,
+				(cache->range_count + 1) * sizeof (cache_range_t));
+		memmove (cache->ranges + i + 1, cache->ranges + i,
+				(cache->range_count - i) * sizeof (cache_range_t));
+		cache->range_count++;
+	} else {
+		memmove (cache->ranges + i + 1, cache->ranges + j,
+				(cache->range_count - j) * sizeof (cache_range_t));
+		cache->range_count -= j - i - 1;
+	}
+
+	cache->ranges[i].start = start;
+	cache->ranges[i].end   = end;
+}
+
+static void
+read_ranges (cache_t *cache)
+{
+	FILE *file = fopen (cache->ranges_path, "r");
+	unsigned int start, end;
+
+	if (file == NULL)
+		return;
+
+	while (fscanf (file, "%u %u", &start, &end) == 2)
+		add_range (cache, start, end);
+
+	fclose (file);
+}
+
+static void
+write_ranges (cache_t *cache)
+{
+	FILE *file = fopen (cache->ranges_path, "w");
+
+	if (file == NULL) {
+		print_error ("Could not write %s - %s\n", cache->ranges_path, strerror (errno));
+		return;
+	}
+
+	for (int i = 0; i < cache->range_count; i++)
+		fprintf (file, "%u %u\n", cache->ranges[i].start, cache->ranges[i].end);
+
+	fclose (file);
+}
+
+/* Opens the cache entry for a stream, creating it if needed. The stream is
+ * identified by its length and a hash of its ASF header, so mirrors of the
+ * same stream share an entry.
+ * Returns false if the cache can not be used.
+ */
+bool
+cache_open (cache_t *cache, const char *dir, uint64_t max_size,
+            uint32_t len, const char *header, uint32_t header_len)
+{
+	struct stat st;
+	char key[64];
+
+	memset (cache, 0, sizeof (cache_t));
+	cache->dir = dir;
+	cache->max_size = max_size;
+	cache->fd = -1;
+
+	if (mkdir (dir, 0755) && errno != EEXIST) {
+		print_error ("Could not create %s - %s\n", dir, strerror (errno));
+		return false;
+	}
+
+	sprintf (key, "%08x%08x%016llx", len, crc32c_update (0, header, header_len),
+			(unsigned long long)fnv1a (header, header_len));
+
+	cache->data_path   = cache_path (dir, key, ".data");
+	cache->ranges_path = cache_path (dir, key, ".ranges");
+
+	if ((cache->fd = open (cache->data_path, O_RDWR | O_CREAT, 0644)) < 0) {
+		print_error ("Could not open %s - %s\n", cache->data_path, strerror (errno));
+		cache_close (cache);
+		return false;
+	}
+
+	/* A data file of the wrong size can not be trusted */
+	if (fstat (cache->fd, &st) || st.st_size != len) {
+		if (ftruncate (cache->fd, 0) || ftruncate (cache->fd, len)) {
+			print_error ("ftruncate failed %s\n", strerror (errno));
+			cache_close (cache);
+			return false;
+		}
+		unlink (cache->ranges_path);
+	} else {
+		read_ranges (cache);
+	}
+
+	/* Mark the entry as recently used */
+	futimens (cache->fd, NULL);
+
+	return true;
+}
+
+/* Returns how many bytes from start and onwards are in the cache, at most
+ * len.
+ */
+uint32_t
+cache_lookup (cache_t *cache, uint32_t start, uint32_t len)
+{
+	for (int i = 0; i < cache->range_count; i++) {
+		cache_range_t *range = cache->ranges + i;
+
+		if (range->start <= start && start < range->end)
+			return range->end - start < len ? range->end - start : len;
+	}
+
+	return 0;
+}
+
+/* Copies len bytes at off from one file to the other. Uses copy_file_range
+ * when it is available, which lets file systems that support it share the
+ * data blocks instead of copying them.
+ */
+static bool
+copy_range (int from, int to, uint32_t off, uint32_t len)
+{
+	static char buf[COPY_BUF_SIZE];
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len > 0) {
+		loff_t off_in = off, off_out = off;
+		ssize_t n = copy_file_range (from, &off_in, to, &off_out, len, 0);
+
+		if (n <= 0)
+			break;
+
+		off += n;
+		len -= n;
+	}
+#endif
+
+	/* Fall back to reading and writing */
+	while (len > 0) {
+		ssize_t n = pread (from, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, off);
+
+		if (n <= 0 || pwrite (to, buf, n, off) != n)
+			return false;
+
+		off += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Copies len bytes at start from the cache to fd */
+bool
+cache_read (cache_t *cache, int fd, uint32_t start, uint32_t len)
+{
+	if (!copy_range (cache->fd, fd, start, len)) {
+		print_error ("Could not read from the cache - %s\n", strerror (errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* Copies len bytes at start from fd to the cache */
+bool
+cache_store (cache_t *cache, int fd, uint32_t start, uint32_t len)
+{
+	if (len == 0 || cache_lookup (cache, start, len) == len)
+		return true;
+
+	if (!copy_range (fd, cache->fd, start, len)) {
+		print_error ("Could not write to the cache - %s\n", strerror (errno));
+		return false;
+	}
+
+	add_range (cache, start, start + len);
+	cache->dirty = true;
+
+	return true;
+}
+
+typedef struct {
+	char *key;
+	uint64_t size;
+	time_t mtime;
+} cache_entry_t;
+
+static int
+compare_entries (const void *a, const void *b)
+{
+	const cache_entry_t *ea = a, *eb = b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Removes the least recently used entries until the cache fits in its
+ * maximum size. The entry in use is never removed.
+ */
+static void
+cache_evict (cache_t *cache)
+{
+	cache_entry_t *entries = NULL;
+	int entry_count = 0;
+	uint64_t total = 0;
+	struct dirent *ent;
+	DIR *dir;
+
+	if (!(dir = opendir (cache->dir)))
+		return;
+
+	while ((ent = readdir (dir)) != NULL) {
+		size_t name_len = strlen (ent->d_name);
+		char *key, *path;
+		struct stat st;
+
+		if (name_len < 5 || strcmp (ent->d_name + name_len - 5, ".data"))
+			continue;
+
+		key  = strndup (ent->d_name, name_len - 5);
+		path = cache_path (cache->dir, key, ".data");
+
+		if (stat (path, &st)) {
+			free (path);
+			free (key);
+			continue;
+		}
+
+		/* Count the blocks in use, the data files are sparse */
+		total += (uint64_t)st.st_blocks * 512;
+
+		if (!strcmp (path, cache->data_path)) {
+			free (path);
+			free (key);
+			continue;
+		}
+
+		free (path);
+
+		entries = realloc (entries, (entry_count + 1) * sizeof (cache_entry_t));
+		entries[entry_count].key   = key;
+		entries[entry_count].size  = (uint64_t)st.st_blocks * 512;
+		entries[entry_count].mtime = st.st_mtime;
+		entry_count++;
+	}
+
+	closedir (dir);
+
+	qsort (entries, entry_count, sizeof (cache_entry_t), compare_entries);
+
+	for (int i = 0; i < entry_count; i++) {
+		if (total > cache->max_size) {
+			char *data_path   = cache_path (cache->dir, entries[i].key, ".data");
+			char *ranges_path = cache_path (cache->dir, entries[i].key, ".ranges");
+
+			print_info (2, "Removing %s from the cache\n", data_path);
+			unlink (data_path);
+			unlink (ranges_path);
+
+			free (data_path);
+			free (ranges_path);
+
+			total -= entries[i].size;
+		}
+
+		free (entries[i].key);
+	}
+
+	free (entries);
+}
+
+void
+cache_close (cache_t *cache)
+{
+	if (cache->dirty)
+		write_ranges (cache);
+
+	if (cache->fd >= 0) {
+		close (cache->fd);
+		cache_evict (cache);
+	}
+
+	free (cache->data_path);
+	free (cache->ranges_path);
+	free (cache->ranges);
+}
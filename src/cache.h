@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	uint32_t start, end;
+} cache_range_t;
+
+/* A stream in the cache, stored as a sparse data file the size of the
+ * stream and a list of the ranges in it that hold valid data.
+ */
+typedef struct {
+	const char *dir;
+	uint64_t max_size;
+	char *data_path;
+	char *ranges_path;
+	int fd;
+
+	cache_range_t *ranges;
+	int range_count;
+	bool dirty;
+} cache_t;
+
+bool     cache_open   (cache_t *cache, const char *dir, uint64_t max_size,
+                       uint32_t len, const char *header, uint32_t header_len);
+uint32_t cache_lookup (cache_t *cache, uint32_t start, uint32_t len);
+bool     cache_read   (cache_t *cache, int fd, uint32_t start, uint32_t len);
+bool     cache_store  (cache_t *cache, int fd, uint32_t start, uint32_t len);
+void     cache_close  (cache_t *cache);
+
+#endif /* _CACHE_H_ */
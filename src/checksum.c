@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "checksum.h"
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+/* The reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool have_sse42;
+
+static void
+crc32c_init ()
+{
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+
+		crc_table[0][i] = crc;
+	}
+
+	/* Tables for slicing-by-8 */
+	for (int i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++) {
+			uint32_t crc = crc_table[j - 1][i];
+			crc_table[j][i] = (crc >> 8) ^ crc_table[0][crc & 0xff];
+		}
+	}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	have_sse42 = __builtin_cpu_supports ("sse4.2");
+#endif
+}
+
+static uint32_t
+crc32c_sw (uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		      crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+		      crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/* Uses the crc32 instruction from SSE 4.2, which implements CRC32C */
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+crc32c_hw (uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc64;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		crc = __builtin_ia32_crc32qi (crc, *p++);
+		len--;
+	}
+
+	crc64 = crc;
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy (&word, p, 8);
+		crc64 = __builtin_ia32_crc32di (crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+
+	while (len-- > 0)
+		crc = __builtin_ia32_crc32qi (crc, *p++);
+
+	return crc;
+}
+#endif
+
+/* Updates crc with len bytes of data. Start with a crc of 0. */
+uint32_t
+crc32c_update (uint32_t crc, const void *data, size_t len)
+{
+	pthread_once (&crc_once, crc32c_init);
+
+	crc = ~crc;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (have_sse42)
+		return ~crc32c_hw (crc, data, len);
+#endif
+
+	return ~crc32c_sw (crc, data, len);
+}
+
+static uint32_t
+gf2_matrix_times (const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++) {
+		if (vec & 1)
+			sum ^= *mat;
+	}
+
+	return sum;
+}
+
+static void
+gf2_matrix_square (uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times (mat, mat[n]);
+}
+
+/* Returns the crc of two concatenated blocks, given the crc of each of them
+ * and the length of the second one. Works like zlib's crc32_combine.
+ */
+uint32_t
+crc32c_combine (uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	if (len2 == 0)
+		return crc1;
+
+	/* Operator for one zero bit */
+	odd[0] = CRC32C_POLY;
+	for (int n = 1; n < 32; n++)
+		odd[n] = 1u << (n - 1);
+
+	/* Operators for two and four zero bits */
+	gf2_matrix_square (even, odd);
+	gf2_matrix_square (odd, even);
+
+	/* Apply len2 zero bytes to crc1 */
+	do {
+		gf2_matrix_square (even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times (even, crc1);
+		len2 >>= 1;
+
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square (odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times (odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/* Returns the crc of a block of len bytes after the n bytes at off have
+ * changed from old_data to new_data, given the crc from before. A crc is
+ * linear, so each byte that changed flips the crc by the crc of the
+ * difference, shifted by the number of bytes after it.
+ */
+uint32_t
+crc32c_patch (uint32_t crc, uint64_t len, uint64_t off,
+              const void *old_data, const void *new_data, size_t n)
+{
+	const uint8_t *a = old_data, *b = new_data;
+	const uint8_t zero = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		uint8_t diff = a[i] ^ b[i];
+
+		if (diff == 0)
+			continue;
+
+		crc ^= crc32c_combine (crc32c_update (0, &diff, 1) ^ crc32c_update (0, &zero, 1),
+				0, len - off - i - 1);
+	}
+
+	return crc;
+}
@@ -20,6 +20,11 @@
 #include "fifo.h"
 #include <stdlib.h>
 
+/* Minimum number of spins once spinning is enabled, so fifo_pop can find
+ * out that it pays off again.
+ */
+#define SPIN_MIN 16
+
 struct fifo_item_St {
 	void *data;
 
@@ -27,6 +32,19 @@ struct fifo_item_St {
 	fifo_item_t *prev;
 };
 
+/* Initializes a FIFO that is not set up with FIFO_INITIALIZER */
+void
+fifo_init (fifo_t *fifo)
+{
+	fifo->head = NULL;
+	fifo->tail = NULL;
+	pthread_mutex_init (&fifo->lock, NULL);
+	pthread_cond_init (&fifo->cond, NULL);
+	fifo->signal = false;
+	fifo->spin = 0;
+	fifo->spin_max = 0;
+}
+
 /* Adds an element to the front of the FIFO */
 void
 fifo_push (fifo_t *fifo, void *elem)
@@ -45,12 +63,47 @@ fifo_push (fifo_t *fifo, void *elem)
 	fifo->head = item;
 
 	if (fifo->tail == NULL)
-		fifo->tail = item;
+		__atomic_store_n (&fifo->tail, item, __ATOMIC_RELEASE);
 
 	pthread_cond_signal (&fifo->cond);
 	pthread_mutex_unlock (&fifo->lock);
 }
 
+static inline void
+cpu_relax ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause ();
+#endif
+}
+
+/* Spins for a while waiting for an element, which is cheaper than being
+ * woken up if one arrives shortly. The spin time grows while spinning pays
+ * off, and shrinks when it does not.
+ */
+static void
+fifo_spin (fifo_t *fifo)
+{
+	int i;
+
+	for (i = 0; i < fifo->spin; i++) {
+		if (__atomic_load_n (&fifo->tail, __ATOMIC_ACQUIRE) != NULL ||
+		    __atomic_load_n (&fifo->signal, __ATOMIC_RELAXED))
+			break;
+
+		cpu_relax ();
+	}
+
+	if (i < fifo->spin) {
+		fifo->spin = fifo->spin * 2 < fifo->spin_max ? fifo->spin * 2 : fifo->spin_max;
+	} else {
+		fifo->spin = fifo->spin / 2 > SPIN_MIN ? fifo->spin / 2 : SPIN_MIN;
+
+		if (fifo->spin > fifo->spin_max)
+			fifo->spin = fifo->spin_max;
+	}
+}
+
 /* Removes the oldest element from the FIFO and returns it.
  * If the FIFO is empty and fifo_signal has been called, it will return NULL.
  */
@@ -60,6 +113,9 @@ fifo_pop (fifo_t *fifo)
 	void *ret = NULL;
 	fifo_item_t *item = NULL;
 
+	if (fifo->spin_max > 0 && __atomic_load_n (&fifo->tail, __ATOMIC_ACQUIRE) == NULL)
+		fifo_spin (fifo);
+
 	pthread_mutex_lock (&fifo->lock);
 
 	while (fifo->tail == NULL && !fifo->signal) {
@@ -68,7 +124,7 @@ fifo_pop (fifo_t *fifo)
 
 	if (fifo->tail != NULL) {
 		item = fifo->tail;
-		fifo->tail = item->prev;
+		__atomic_store_n (&fifo->tail, item->prev, __ATOMIC_RELAXED);
 	}
 
 	if (fifo->tail == NULL) {
@@ -93,8 +149,18 @@ fifo_signal (fifo_t *fifo)
 {
 	pthread_mutex_lock (&fifo->lock);
 
-	fifo->signal = true;
+	__atomic_store_n (&fifo->signal, true, __ATOMIC_RELAXED);
 
 	pthread_cond_signal (&fifo->cond);
 	pthread_mutex_unlock (&fifo->lock);
 }
+
+/* Makes fifo_pop spin up to spin_max times before it goes to sleep.
+ * Only for FIFOs with a single consumer.
+ */
+void
+fifo_set_spin (fifo_t *fifo, int spin_max)
+{
+	fifo->spin_max = spin_max;
+	fifo->spin = spin_max < SPIN_MIN ? spin_max : SPIN_MIN;
+}
@@ -33,6 +33,10 @@ typedef struct {
 	pthread_mutex_t lock;
 	pthread_cond_t  cond;
 	bool signal;
+
+	/* How long fifo_pop spins before sleeping, see fifo_set_spin */
+	int spin;
+	int spin_max;
 } fifo_t;
 
 #define FIFO_INITIALIZER {\
@@ -40,11 +44,15 @@ typedef struct {
 	.tail = NULL,\
 	.lock = PTHREAD_MUTEX_INITIALIZER,\
 	.cond = PTHREAD_COND_INITIALIZER,\
-	.signal = false\
+	.signal = false,\
+	.spin = 0,\
+	.spin_max = 0\
 }
 
-void   fifo_push   (fifo_t *fifo, void *elem);
-void  *fifo_pop    (fifo_t *fifo);
-void   fifo_signal (fifo_t *fifo);
+void   fifo_init     (fifo_t *fifo);
+void   fifo_push     (fifo_t *fifo, void *elem);
+void  *fifo_pop      (fifo_t *fifo);
+void   fifo_signal   (fifo_t *fifo);
+void   fifo_set_spin (fifo_t *fifo, int spin_max);
 
 #endif /* _FIFO_H_ */
@@ -24,42 +24,79 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
 #include <sys/time.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <libmms/mmsx.h>
 #include "fifo.h"
 #include "print.h"
 #include "options.h"
+#include "checksum.h"
+#include "asf.h"
+#include "cache.h"
+#include "output.h"
+#include "affinity.h"
 
 #define BUF_SIZE     (16 * 1024)
 
 typedef struct {
 	char data[BUF_SIZE];
 	uint32_t len, off;
+
+	/* The pool the buffer goes back to when it has been written */
+	fifo_t *home;
 } buf_t;
 
 fifo_t dirty_bufs = FIFO_INITIALIZER;
 fifo_t clean_bufs = FIFO_INITIALIZER;
 
 #define add_dirty_buf(b) fifo_push (&dirty_bufs, b)
-#define add_clean_buf(b) fifo_push (&clean_bufs, b)
+#define add_clean_buf(b) fifo_push ((b)->home, b)
 #define get_dirty_buf()  fifo_pop  (&dirty_bufs)
 #define get_clean_buf()  fifo_pop  (&clean_bufs)
 
+/* Buffers in the pool per download thread */
+#define BUFS_PER_THREAD 2
+
+/* Adds a new buffer to a pool */
+static void
+add_new_buf (fifo_t *pool)
+{
+	buf_t *buf = malloc (sizeof (buf_t));
+
+	buf->home = pool;
+	fifo_push (pool, buf);
+}
+
 typedef struct {
 	uint32_t len;
-	FILE *file;
+	uint32_t cached;
+	output_t *output;
 	const char *filename;
 	bool progress_bar;
+	asf_index_t *index;
+	cpu_list_t *cpus;
+
+	/* Set if some of the data could not be written */
+	bool failed;
 } write_info_t;
 
 static void *
 write_thread (void *arg)
 {
 	write_info_t *info = arg;
-	uint32_t bytes_transfered = 0;
+	uint32_t bytes_transfered = info->cached;
+
+	print_set_tag ("writer");
+
+	if (info->cpus != NULL)
+		affinity_pin_all (info->cpus);
 
 	if (info->progress_bar)
-		print_progress (info->filename, 0, info->len);
+		print_progress (info->filename, bytes_transfered, info->len);
 
 	while (1) {
 		buf_t *buf = get_dirty_buf ();
@@ -68,8 +105,13 @@ write_thread (void *arg)
 		if (buf == NULL)
 			break;
 
-		fseek (info->file, buf->off, SEEK_SET);
-		fwrite (buf->data, 1, buf->len, info->file);
+		if (!output_write (info->output, buf->data, buf->len, buf->off) && !info->failed) {
+			print_error ("Could not write to %s - %s\n", info->filename, strerror (errno));
+			info->failed = true;
+		}
+
+		if (info->index)
+			asf_index_add (info->index, buf->off, buf->data, buf->len);
 
 		bytes_transfered += buf->len;
 		if (info->progress_bar)
@@ -83,16 +125,290 @@ write_thread (void *arg)
 	return NULL;
 }
 
+/* A server the stream can be downloaded from. When mirror URLs are given
+ * there is one of these for each of them, and the download threads pick the
+ * source to connect to based on the throughput measured so far.
+ */
+typedef struct {
+	const char *url;
+	int connections;
+	int failures;
+	bool dead;
+
+	/* Connections the source accepts, 0 for no limit. Lowered when the
+	 * source refuses connections while others are open.
+	 */
+	int limit;
+
+	/* Bytes received from this source, and the time spent receiving them */
+	uint64_t bytes;
+	double time;
+} source_t;
+
+/* Number of failures in a row before a source is given up */
+#define MAX_SOURCE_FAILURES 3
+
+static source_t *sources;
+static int source_count;
+static int max_connections;
+
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sources_cond = PTHREAD_COND_INITIALIZER;
+
 typedef struct {
 	uint32_t start, len;
 	int bandwidth;
-	const char *url;
 	bool finished;
+
+	/* The whole range, and the CRC32C of the part received so far */
+	uint32_t range_start, range_len;
+	bool cached;
+	bool checksum;
+	uint32_t crc;
+
+	/* Where the data packets start and their size, 0 if unknown */
+	uint32_t data_offset, packet_len;
+
+	/* The thread downloading the range, and what it holds */
+	pthread_t thread;
+	bool running;
+	int retries;
+	bool throttled;
+	source_t *source;
+	mmsx_t *conn;
+	buf_t *buf;
+	double start_time;
+
+	/* Bytes per second the last thread got, 0 if unknown */
+	double rate;
+
+	/* The CPUs to run on, NULL to run anywhere. When set, the range has a
+	 * pool of buffers allocated from its CPU.
+	 */
+	cpu_list_t *cpus;
+	int index;
+	fifo_t pool;
+	bool pool_filled;
+
+	/* Bytes received by the current thread, and the bytes it has read
+	 * including those skipped while seeking. Once the thread has a
+	 * connection slot, the watchdog checks that the progress goes on.
+	 */
+	atomic_uint_fast64_t received, progress;
+	bool watching, stalled, connecting;
+	uint64_t window_bytes;
+	double window_start;
 } download_info_t;
 
+/* Download threads put their info here when they exit */
+fifo_t done_infos = FIFO_INITIALIZER;
+
+/* The ranges of the download. A range is added when what is left of a slow
+ * range is split off to a thread that has finished.
+ */
+static download_info_t **infos;
+static int info_count;
+
+/* Protects the infos array, and the start, len, range_len, thread, running
+ * and window fields of the infos
+ */
+static pthread_mutex_t infos_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of times a range is restarted without getting any data */
+#define MAX_RANGE_RETRIES 5
+
+/* Smallest part of a range that is split off to another thread */
+#define MIN_SPLIT_LEN (16 * BUF_SIZE)
+
+/* Cleared when the server can not seek, as a new connection then has to
+ * read the stream from the start, and splitting ranges does not pay off
+ */
+static atomic_bool seek_supported = true;
+
+static double
+time_now ()
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+/* Returns true if getting bytes in elapsed seconds is a stall. With a
+ * min_rate of 0, only getting no data at all is.
+ */
+static bool
+is_stalled (uint64_t bytes, double elapsed, double min_rate)
+{
+	return bytes == 0 || bytes / elapsed < min_rate;
+}
+
+/* Only there to interrupt a blocked network call */
+static void
+wake_up (int sig)
+{
+}
+
+static double
+source_throughput (source_t *source)
+{
+	return source->time > 0 ? source->bytes / source->time : 0;
+}
+
+/* Picks the source a new connection should use, and reserves a connection
+ * slot on it. The sources are weighted by their measured throughput, sources
+ * that have not been measured yet are assumed to be as fast as the fastest
+ * one. Waits for a free slot if every source is at its connection limit.
+ * Returns NULL if every source is dead.
+ */
+static source_t *
+source_get ()
+{
+	source_t *best;
+
+	pthread_mutex_lock (&sources_lock);
+
+	while (1) {
+		double fastest = 0, best_load = 0;
+		bool alive = false;
+
+		best = NULL;
+
+		for (int i = 0; i < source_count; i++) {
+			if (source_throughput (sources + i) > fastest)
+				fastest = source_throughput (sources + i);
+		}
+
+		for (int i = 0; i < source_count; i++) {
+			source_t *source = sources + i;
+			double throughput, load;
+
+			if (source->dead)
+				continue;
+
+			alive = true;
+
+			if (source->limit > 0 && source->connections >= source->limit)
+				continue;
+
+			throughput = source_throughput (source);
+			if (throughput == 0)
+				throughput = fastest > 0 ? fastest : 1;
 
+			load = (source->connections + 1) / throughput;
+
+			if (best == NULL || load < best_load) {
+				best = source;
+				best_load = load;
+			}
+		}
+
+		if (best != NULL || !alive)
+			break;
+
+		pthread_cond_wait (&sources_cond, &sources_lock);
+	}
+
+	if (best != NULL)
+		best->connections++;
+
+	pthread_mutex_unlock (&sources_lock);
+
+	return best;
+}
+
+/* Counts a failure of source, and gives it up after too many of them in a
+ * row. The last live source is never given up, the ranges have their own
+ * retry limit. Must be called with sources_lock held.
+ */
+static void
+source_failed (source_t *source)
+{
+	int alive = 0;
+
+	for (int i = 0; i < source_count; i++) {
+		if (!sources[i].dead)
+			alive++;
+	}
+
+	if (++source->failures >= MAX_SOURCE_FAILURES && !source->dead && alive > 1) {
+		source->dead = true;
+		print_error ("Giving up on %s\n", source->url);
+	}
+}
+
+/* Releases a connection slot reserved with source_get, and records how the
+ * connection went.
+ */
+static void
+source_put (source_t *source, uint64_t bytes, double time, bool failed)
+{
+	pthread_mutex_lock (&sources_lock);
+
+	source->connections--;
+	source->bytes += bytes;
+	source->time  += time;
+
+	if (bytes > 0)
+		source->failures = 0;
+
+	if (failed)
+		source_failed (source);
+
+	pthread_cond_broadcast (&sources_cond);
+	pthread_mutex_unlock (&sources_lock);
+}
+
+/* Releases a connection slot whose connection could not be opened. If the
+ * source has other connections open, it most likely limits the connections
+ * per client, so its limit is lowered instead of counting a failure.
+ * Returns true in that case.
+ */
+static bool
+source_refused (source_t *source)
+{
+	bool throttled;
+
+	pthread_mutex_lock (&sources_lock);
+
+	source->connections--;
+	throttled = source->connections > 0;
+
+	if (!throttled) {
+		source_failed (source);
+	} else if (source->limit == 0 || source->connections < source->limit) {
+		source->limit = source->connections;
+		print_info (1, "%s refused a connection, using at most %i connections to it\n",
+				source->url, source->limit);
+	}
+
+	pthread_cond_broadcast (&sources_cond);
+	pthread_mutex_unlock (&sources_lock);
+
+	return throttled;
+}
+
+static bool
+sources_dead ()
+{
+	bool dead = true;
+
+	pthread_mutex_lock (&sources_lock);
+
+	for (int i = 0; i < source_count; i++) {
+		if (!sources[i].dead)
+			dead = false;
+	}
+
+	pthread_mutex_unlock (&sources_lock);
+
+	return dead;
+}
+
+/* Seeks to pos, adding the bytes read to get there to progress */
 static void
-seek (mmsx_t *conn, uint32_t pos)
+seek (mmsx_t *conn, uint32_t pos, atomic_uint_fast64_t *progress)
 {
 	static char seek_buf[BUF_SIZE];
 	mms_off_t off;
@@ -102,208 +418,1554 @@ seek (mmsx_t *conn, uint32_t pos)
 	if (off != pos) {
 		/* TODO: Implement binary search with mmsx_time_seek */
 		print_error ("mmsx_seek not supported\n");
+		atomic_store (&seek_supported, false);
 
 		while (off < pos) {
 			mms_off_t left = pos - off;
 			int data_read  = mmsx_read (NULL, conn, seek_buf, left > BUF_SIZE ? BUF_SIZE : left);
 
 			/* At the end of the stream, can not seek any further */
-			if (data_read == 0)
+			if (data_read <= 0)
 				break;
 
-			pos += data_read;
+			off += data_read;
+			atomic_fetch_add (progress, data_read);
 		}
 	}
 }
 
+/* Releases what a download thread holds when it exits or is cancelled,
+ * and hands the range back to download().
+ */
+static void
+download_cleanup (void *arg)
+{
+	download_info_t *info = arg;
+	uint64_t received = atomic_load (&info->received);
+	bool stalled;
+
+	if (info->buf != NULL) {
+		add_clean_buf (info->buf);
+		info->buf = NULL;
+	}
+
+	if (info->conn != NULL) {
+		mmsx_close (info->conn);
+		info->conn = NULL;
+	}
+
+	pthread_mutex_lock (&infos_lock);
+	info->finished = (info->len == 0);
+	info->running = false;
+	stalled = info->stalled;
+	pthread_mutex_unlock (&infos_lock);
+
+	info->rate = 0;
+	if (received > 0 && time_now () > info->start_time)
+		info->rate = received / (time_now () - info->start_time);
+
+	/* A connection the watchdog gave up after it got some data is not
+	 * counted against the source, a slow source is still a working one.
+	 */
+	if (info->source != NULL) {
+		source_put (info->source, received,
+				received > 0 ? time_now () - info->start_time : 0,
+				!info->finished && !(stalled && received > 0));
+		info->source = NULL;
+	}
+
+	fifo_push (&done_infos, info);
+}
+
+/* Starts a new stall window for the thread downloading info */
+static void
+download_watch (download_info_t *info)
+{
+	pthread_mutex_lock (&infos_lock);
+
+	info->watching = true;
+	info->window_bytes = atomic_load (&info->progress);
+	info->window_start = time_now ();
+
+	pthread_mutex_unlock (&infos_lock);
+}
+
+/* Downloads the range given by info. The range is updated as data is
+ * received, so if the connection fails a new thread can continue where
+ * this one stopped, possibly from another source.
+ * The thread can only be cancelled while it waits for data. While it
+ * connects, the connection would leak, so the watchdog interrupts it with
+ * SIGALRM instead.
+ */
 static void *
 download_thread (void *arg)
 {
 	download_info_t *info = arg;
-	uint32_t pos  = info->start;
-	uint32_t left = info->len;
 	mmsx_t *conn;
+	bool check_packet, stalled;
+
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push (download_cleanup, info);
+
+	print_set_tag ("%u-%u", info->range_start, info->range_start + info->range_len);
+
+	/* Fill the buffers from the pinned CPU, so the memory is allocated on
+	 * its NUMA node.
+	 */
+	if (info->cpus != NULL) {
+		affinity_pin_index (info->cpus, info->index);
+
+		for (int i = 0; !info->pool_filled && i < BUFS_PER_THREAD; i++) {
+			buf_t *buf = malloc (sizeof (buf_t));
+
+			memset (buf->data, 0, BUF_SIZE);
+			buf->home = &info->pool;
+			fifo_push (&info->pool, buf);
+		}
+		info->pool_filled = true;
+	}
+
+	info->source = source_get ();
+
+	if (info->source == NULL)
+		goto out;
+
+	/* Waiting for a connection slot does not count as a stall */
+	download_watch (info);
+
+	pthread_mutex_lock (&infos_lock);
+	info->connecting = true;
+	pthread_mutex_unlock (&infos_lock);
 
-	conn = mmsx_connect (NULL, NULL, info->url, info->bandwidth);
+	conn = mmsx_connect (NULL, NULL, info->source->url, info->bandwidth);
 
-	if (conn == NULL) {
-		print_error ("Could not open %s\n", info->url);
-		info->finished = false;
-		pthread_exit (NULL);
+	pthread_mutex_lock (&infos_lock);
+	info->connecting = false;
+	info->conn = conn;
+	stalled = info->stalled;
+	pthread_mutex_unlock (&infos_lock);
+
+	if (stalled)
+		goto out;
+
+	if (info->conn == NULL) {
+		print_error ("Could not open %s\n", info->source->url);
+		info->throttled = source_refused (info->source);
+		info->source = NULL;
+		goto out;
 	}
 
-	seek (conn, pos);
+	print_info (2, "Downloading %u bytes at %u from %s\n",
+	               info->len, info->start, info->source->url);
+
+	pthread_mutex_lock (&infos_lock);
+	info->start_time = time_now ();
+	pthread_mutex_unlock (&infos_lock);
+
+	pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+	seek (info->conn, info->start, &info->progress);
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
 
-	while (left > 0) {
+	download_watch (info);
+
+	/* If we start at a packet boundary, check that the stream really has a
+	 * packet there. This catches ranges that would not join up correctly.
+	 */
+	check_packet = info->packet_len > 0 && info->start >= info->data_offset &&
+	               (info->start - info->data_offset) % info->packet_len == 0;
+
+	while (1) {
 		int bytes_read;
-		buf_t *buf = get_clean_buf ();
+		uint32_t left;
+		buf_t *buf;
+
+		/* The end of the range can be split off by download() */
+		pthread_mutex_lock (&infos_lock);
+		left = info->len;
+		pthread_mutex_unlock (&infos_lock);
 
-		bytes_read = mmsx_read (NULL, conn, buf->data,
+		if (left == 0)
+			break;
+
+		buf = info->buf = info->cpus ? fifo_pop (&info->pool) : get_clean_buf ();
+
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+		bytes_read = mmsx_read (NULL, info->conn, buf->data,
 				left < BUF_SIZE ? left : BUF_SIZE);
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (bytes_read <= 0)
+			break;
+
+		if (check_packet && !asf_packet_check (buf->data, bytes_read)) {
+			print_error ("No valid ASF packet at %u from %s\n",
+					info->start, info->source->url);
+			break;
+		}
+		check_packet = false;
 
-		if (bytes_read == 0) break;
+		/* Drop what was split off while reading */
+		pthread_mutex_lock (&infos_lock);
+		if ((uint32_t)bytes_read > info->len)
+			bytes_read = info->len;
 
-		buf->off = pos;
+		buf->off = info->start;
 		buf->len = bytes_read;
 
-		pos += bytes_read;
-		left -= bytes_read;
+		info->start += bytes_read;
+		info->len   -= bytes_read;
+		pthread_mutex_unlock (&infos_lock);
 
+		if (bytes_read == 0)
+			break;
+
+		if (info->checksum)
+			info->crc = crc32c_update (info->crc, buf->data, bytes_read);
+
+		atomic_fetch_add (&info->received, bytes_read);
+		atomic_fetch_add (&info->progress, bytes_read);
+
+		info->buf = NULL;
 		add_dirty_buf (buf);
 	}
 
-	mmsx_close (conn);
-
-	info->finished = true;
+out:
+	pthread_cleanup_pop (1);
 
 	return NULL;
 }
 
-/* Tries to connect to the stream to retrieve some information about it
- * Returns true on success, false on error.
- */
-static bool
-mmsx_get_info (const char *url, uint32_t *len, bool *seekable, int bandwidth)
+/* Starts a thread downloading what is left of the range in info */
+static void
+download_start (download_info_t *info)
 {
-	mmsx_t *mmsx;
+	pthread_mutex_lock (&infos_lock);
 
-	print_info (1, "Connecting to %s...\n", url);
+	atomic_store (&info->received, 0);
+	atomic_store (&info->progress, 0);
+	info->watching = false;
+	info->stalled = false;
+	info->connecting = false;
+	info->start_time = 0;
+	info->running = true;
+	info->throttled = false;
 
-	mmsx = mmsx_connect (NULL, NULL, url, bandwidth);
+	pthread_create (&info->thread, NULL, download_thread, info);
 
-	if (mmsx == NULL) {
-		print_error ("Could not connect to %s\n", url);
-		return false;
-	}
+	pthread_mutex_unlock (&infos_lock);
+}
 
-	*len      = mmsx_get_length (mmsx);
-	*seekable = mmsx_get_seekable (mmsx);
+/* Adds a range to the infos array */
+static download_info_t *
+download_add (uint32_t start, uint32_t len)
+{
+	download_info_t *info = calloc (1, sizeof (download_info_t));
 
-	print_info (2, "Stream length:   %i bytes\n"
-	               "Stream seekable: %s\n",
-	               len, seekable ? "true" : "false");
+	info->start       = start;
+	info->len         = len;
+	info->range_start = start;
+	info->range_len   = len;
+	fifo_init (&info->pool);
 
-	mmsx_close (mmsx);
+	pthread_mutex_lock (&infos_lock);
+	infos = realloc (infos, (info_count + 1) * sizeof (download_info_t *));
+	infos[info_count++] = info;
+	pthread_mutex_unlock (&infos_lock);
 
-	return true;
+	return info;
 }
 
-static bool
-download (options_t *options)
+/* Splits what is left of the range expected to finish last, so a thread
+ * that is done can take over the end of it. The split is weighted by the
+ * throughput each of the two threads got, so they should finish at about
+ * the same time. Returns the new range, or NULL if no range is worth
+ * splitting.
+ */
+static download_info_t *
+download_split (download_info_t *done)
 {
-	FILE *file;
-	uint32_t len, len_per_thread;
-	bool seekable;
-	int thread_count = options->thread_count;
-	pthread_t threads[thread_count + 1];
-	download_info_t download_infos[thread_count];
-	write_info_t write_info;
-	int remaining;
-
-	if (!mmsx_get_info (options->url, &len, &seekable, options->bandwidth))
-		return false;
+	download_info_t *slowest = NULL, *info;
+	double now = time_now (), slowest_rate = 0;
+	uint32_t end, split;
+
+	if (done->rate <= 0 || !atomic_load (&seek_supported))
+		return NULL;
+
+	pthread_mutex_lock (&infos_lock);
+
+	/* Ranges that have not got any data yet are the slowest, as long as
+	 * they are connected
+	 */
+	for (int i = 0; i < info_count; i++) {
+		uint64_t received = atomic_load (&infos[i]->received);
+		double rate = 0;
+
+		if (!infos[i]->running || infos[i]->start_time == 0 ||
+		    infos[i]->len < 2 * MIN_SPLIT_LEN)
+			continue;
+
+		if (received > 0 && now > infos[i]->start_time)
+			rate = received / (now - infos[i]->start_time);
+
+		/* Compare the time left, len / rate, without dividing by 0 */
+		if (slowest == NULL || rate * slowest->len < slowest_rate * infos[i]->len ||
+		    (rate == 0 && slowest_rate == 0 && infos[i]->len > slowest->len)) {
+			slowest = infos[i];
+			slowest_rate = rate;
+		}
+	}
 
-	if (!seekable) {
-		print_error ("Stream is not seekable, using a single thread\n");
-		thread_count = 1;
-		/* TODO: Find out if len is correct in this case */
+	if (slowest == NULL) {
+		pthread_mutex_unlock (&infos_lock);
+		return NULL;
 	}
 
-	if (!(file = fopen (options->filename, "w"))) {
-		print_error ("Could not open %s - %s\n",
-				options->filename,
-				strerror (errno));
-		return false;
+	end   = slowest->start + slowest->len;
+	split = slowest->start + slowest->len * (slowest_rate / (slowest_rate + done->rate));
+
+	if (split < slowest->start + MIN_SPLIT_LEN)
+		split = slowest->start + MIN_SPLIT_LEN;
+
+	/* Split at a packet boundary, so the new range can be checked */
+	if (slowest->packet_len > 0 && split > slowest->data_offset) {
+		uint32_t packets = (split - slowest->data_offset + slowest->packet_len - 1) /
+		                   slowest->packet_len;
+
+		split = slowest->data_offset + packets * slowest->packet_len;
 	}
 
-	if (ftruncate (fileno (file), len)) {
-		print_error ("ftruncate failed %s\n",
-				strerror (errno));
-		return false;
+	if (split + MIN_SPLIT_LEN > end) {
+		pthread_mutex_unlock (&infos_lock);
+		return NULL;
 	}
 
-	print_info (1, "Starting download\nUsing %i threads\n", thread_count);
+	slowest->len        = split - slowest->start;
+	slowest->range_len -= end - split;
 
-	/* Get the amount of data each thread should download (rounded up) */
-	len_per_thread = (len + (thread_count - 1)) / thread_count;
+	pthread_mutex_unlock (&infos_lock);
 
-	/* Fill in the info structures for the download threads */
-	for (int i = 0; i < thread_count; i++) {
-		download_info_t *info = download_infos + i;
+	info = download_add (split, end - split);
 
-		info->bandwidth = options->bandwidth;
-		info->url       = options->url;
-		info->start     = len_per_thread * i;
-		info->finished  = false;
+	info->bandwidth   = slowest->bandwidth;
+	info->checksum    = slowest->checksum;
+	info->data_offset = slowest->data_offset;
+	info->packet_len  = slowest->packet_len;
+	info->cpus        = done->cpus;
 
-		/* The last thread might have less data to download */
-		if (i == thread_count - 1) {
-			info->len = len - len_per_thread * (thread_count - 1);
-		} else {
-			info->len = len_per_thread;
-		}
-	}
+	print_info (2, "Splitting off %u bytes at %u\n", info->len, info->start);
 
-	/* Create the thread that writes the data to file */
-	write_info.file = file;
-	write_info.len  = len;
-	write_info.filename     = options->filename;
-	write_info.progress_bar = options->progress_bar;
-	pthread_create (threads + thread_count, NULL, write_thread, &write_info);
+	return info;
+}
 
-	do {
-		/* Start the remaining threads */
-		for (int i = 0; i < thread_count; i++) {
-			if (!download_infos[i].finished)
-				pthread_create (threads + i, NULL, download_thread, download_infos + i);
-		}
+typedef struct {
+	/* A connection is stalled if it gets less than min_rate bytes per
+	 * second over window seconds.
+	 */
+	int window;
+	double min_rate;
 
-		remaining = thread_count;
+	/* Set with infos_lock held, and signalled on watchdog_cond */
+	bool stop;
+} watchdog_t;
 
-		/* Wait for the download threads to finish */
-		for (int i = 0; i < thread_count; i++) {
-			if (!download_infos[i].finished)
-				pthread_join (threads[i], NULL);
+static pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
 
-			if (download_infos[i].finished)
-				remaining--;
-		}
+/* Cancels download threads that have stalled. The range of a cancelled
+ * thread is restarted on a new connection by download().
+ */
+static void *
+watchdog_thread (void *arg)
+{
+	watchdog_t *watchdog = arg;
+
+	print_set_tag ("watchdog");
+
+	pthread_mutex_lock (&infos_lock);
+
+	while (!watchdog->stop) {
+		struct timespec timeout;
+		double now;
 
-		if (remaining == thread_count) {
-			print_error ("All download threads failed\n");
+		clock_gettime (CLOCK_REALTIME, &timeout);
+		timeout.tv_sec++;
+		pthread_cond_timedwait (&watchdog_cond, &infos_lock, &timeout);
+
+		if (watchdog->stop)
 			break;
-		} else if (remaining > 0) {
-			print_info (1, "%i threads did not finish, restarting them\n"
-			               "Try lowering the number of threads\n", remaining);
-		}
-	} while (remaining > 0);
 
+		now = time_now ();
 
-	/* Wait for the write thread to write all the dirty data */
-	fifo_signal (&dirty_bufs);
-	pthread_join (threads[thread_count], NULL);
+		for (int i = 0; i < info_count; i++) {
+			download_info_t *info = infos[i];
+			uint64_t progress = atomic_load (&info->progress);
+			double elapsed = now - info->window_start;
 
-	fclose (file);
+			/* Keep interrupting a connect until it gives up */
+			if (info->stalled && info->connecting) {
+				pthread_kill (info->thread, SIGALRM);
+				continue;
+			}
 
-	print_info (1, "\nDownload complete\n");
+			if (!info->running || !info->watching || elapsed < watchdog->window)
+				continue;
 
-	return true;
+			if (is_stalled (progress - info->window_bytes, elapsed, watchdog->min_rate)) {
+				print_error ("The download of %u bytes at %u has stalled, restarting it\n",
+						info->len, info->start);
+
+				if (info->connecting) {
+					pthread_kill (info->thread, SIGALRM);
+				} else {
+					pthread_cancel (info->thread);
+				}
+
+				info->running = false;
+				info->stalled = true;
+			}
+
+			info->window_bytes = progress;
+			info->window_start = now;
+		}
+	}
+
+	pthread_mutex_unlock (&infos_lock);
+
+	return NULL;
 }
 
-int
-main (int argc, char *argv[])
+typedef struct {
+	uint32_t len;
+	bool seekable;
+	uint32_t header_len;
+	char *header;
+} stream_info_t;
+
+/* Tries to connect to the stream to retrieve some information about it
+ * Returns true on success, false on error.
+ */
+static bool
+mmsx_get_info (const char *url, stream_info_t *stream, int bandwidth)
 {
-	options_t options;
+	mmsx_t *mmsx;
 
-	if (!options_parse (argc, argv, &options))
-		return 1;
+	print_info (1, "Connecting to %s...\n", url);
 
-	print_set_verbosity_level (options.verbosity_level);
+	mmsx = mmsx_connect (NULL, NULL, url, bandwidth);
 
-	for (int i = 0; i < 2 * options.thread_count; i++) {
-		add_clean_buf (malloc (sizeof (buf_t)));
+	if (mmsx == NULL) {
+		print_error ("Could not connect to %s\n", url);
+		return false;
 	}
 
+	stream->len        = mmsx_get_length (mmsx);
+	stream->seekable   = mmsx_get_seekable (mmsx);
+	stream->header_len = mmsx_get_asf_header_len (mmsx);
+	stream->header     = malloc (stream->header_len);
+	stream->header_len = mmsx_peek_header (mmsx, stream->header, stream->header_len);
+
+	print_info (2, "Stream length:   %u bytes\n"
+	               "Stream seekable: %s\n",
+	               stream->len, stream->seekable ? "true" : "false");
+
+	mmsx_close (mmsx);
+
+	return true;
+}
+
+/* Returns true if a and b describe the same stream */
+static bool
+stream_info_equal (stream_info_t *a, stream_info_t *b)
+{
+	return a->len == b->len &&
+	       a->seekable == b->seekable &&
+	       a->header_len == b->header_len &&
+	       memcmp (a->header, b->header, a->header_len) == 0;
+}
+
+/* Probes all the URLs given, and sets up a source for each of them that
+ * serves the same stream as the first one that could be reached.
+ */
+static bool
+sources_init (options_t *options, stream_info_t *stream)
+{
+	bool have_stream = false;
+
+	sources = calloc (options->url_count, sizeof (source_t));
+	source_count = 0;
+	max_connections = options->connections_per_source;
+
+	for (int i = 0; i < options->url_count; i++) {
+		const char *url = options->urls[i];
+		stream_info_t info;
+
+		if (!mmsx_get_info (url, &info, options->bandwidth))
+			continue;
+
+		if (!have_stream) {
+			*stream = info;
+			have_stream = true;
+		} else if (!stream_info_equal (stream, &info)) {
+			print_error ("%s is not the same stream as %s, ignoring it\n",
+					url, sources[0].url);
+			free (info.header);
+			continue;
+		} else {
+			free (info.header);
+		}
+
+		sources[source_count].url   = url;
+		sources[source_count].limit = max_connections;
+		source_count++;
+	}
+
+	return have_stream;
+}
+
+/* Number of buffers a live capture adds to the pool, so the network reads
+ * do not block while the write thread opens or closes a segment.
+ */
+#define LIVE_BUF_COUNT       256
+
+/* Reconnect delay after a live stream drops, doubled for each failure */
+#define LIVE_RECONNECT_DELAY 1
+#define LIVE_MAX_RECONNECTS  8
+
+static volatile sig_atomic_t live_stop = 0;
+
+static void
+live_interrupt (int sig)
+{
+	live_stop = 1;
+}
+
+typedef struct {
+	const char *filename;
+
+	stream_info_t *stream;
+
+	/* Size of the data packets, 0 if unknown */
+	uint32_t packet_len;
+
+	/* When to start a new segment, 0 to never split */
+	uint64_t segment_size;
+	int segment_time;
+
+	/* The open segment */
+	FILE *file;
+	int segment;
+	uint64_t bytes;
+	double start_time;
+	uint64_t prealloc;
+
+	/* Set when a write has failed, which stops the capture */
+	bool failed;
+} live_info_t;
+
+/* Watches the network reads of a live capture */
+typedef struct {
+	pthread_t reader;
+
+	/* The stream has stalled if it gets less than min_rate bytes per
+	 * second over window seconds, 0 to not check.
+	 */
+	int window;
+	double min_rate;
+
+	atomic_uint_fast64_t progress;
+	atomic_bool stalled;
+
+	/* Set with live_lock held */
+	bool watching, stop;
+	uint64_t window_bytes;
+	double window_start;
+} live_watchdog_t;
+
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  live_cond = PTHREAD_COND_INITIALIZER;
+
+/* Returns the size of the data packets of a live stream if whole packets
+ * fit in a buffer, 0 otherwise.
+ */
+static uint32_t
+live_packet_len (stream_info_t *stream)
+{
+	asf_header_t asf;
+
+	if (asf_header_parse (stream->header, stream->header_len, &asf) &&
+	    asf.data_offset == stream->header_len && asf.packet_len <= BUF_SIZE)
+		return asf.packet_len;
+
+	return 0;
+}
+
+/* Returns the filename of the given segment. If the capture is not split,
+ * the first segment gets the filename given by the user, otherwise a number
+ * is added before the extension.
+ */
+static char *
+live_segment_name (live_info_t *info, int segment)
+{
+	const char *ext = strrchr (info->filename, '.');
+	size_t base_len;
+	char *name = malloc (strlen (info->filename) + 16);
+
+	if (info->segment_size == 0 && info->segment_time == 0 && segment == 0)
+		return strcpy (name, info->filename);
+
+	if (ext == NULL || strchr (ext, '/'))
+		ext = info->filename + strlen (info->filename);
+
+	base_len = ext - info->filename;
+	memcpy (name, info->filename, base_len);
+	sprintf (name + base_len, "-%05i%s", segment, ext);
+
+	return name;
+}
+
+/* Stops the capture after a failed write */
+static void
+live_write_failed (live_info_t *info, const char *what, int err)
+{
+	if (!info->failed)
+		print_error ("%s failed - %s\n", what, strerror (err));
+
+	info->failed = true;
+	live_stop = 1;
+}
+
+static void
+live_close_segment (live_info_t *info)
+{
+	stream_info_t *stream = info->stream;
+
+	if (info->file == NULL)
+		return;
+
+	/* Fix up the header, so the segment is a complete file */
+	if (!info->failed && info->packet_len > 0) {
+		uint64_t packets = (info->bytes - stream->header_len) / info->packet_len;
+
+		if (asf_header_set_packets (stream->header, stream->header_len, packets) &&
+		    (fseek (info->file, 0, SEEK_SET) ||
+		     fwrite (stream->header, 1, stream->header_len, info->file) != stream->header_len))
+			live_write_failed (info, "Writing the header", errno);
+	}
+
+	if (fflush (info->file))
+		live_write_failed (info, "Writing the segment", errno);
+
+	/* Remove what is left of the preallocated space */
+	if (ftruncate (fileno (info->file), info->bytes))
+		live_write_failed (info, "ftruncate", errno);
+
+	if (fclose (info->file))
+		live_write_failed (info, "Closing the segment", errno);
+
+	info->file = NULL;
+
+	/* Preallocate the next segment as much as this one got */
+	if (info->segment_size == 0)
+		info->prealloc = info->bytes;
+}
+
+static bool
+live_open_segment (live_info_t *info)
+{
+	char *name = live_segment_name (info, info->segment);
+	int err;
+
+	if (!(info->file = fopen (name, "w"))) {
+		print_error ("Could not open %s - %s\n", name, strerror (errno));
+		free (name);
+		return false;
+	}
+
+	print_info (1, "Writing %s\n", name);
+	free (name);
+
+	if (info->prealloc > 0 &&
+	    (err = posix_fallocate (fileno (info->file), 0, info->prealloc)))
+		live_write_failed (info, "Preallocating the segment", err);
+	else if (fwrite (info->stream->header, 1, info->stream->header_len, info->file) !=
+	         info->stream->header_len)
+		live_write_failed (info, "Writing the header", errno);
+
+	info->bytes = info->stream->header_len;
+	info->start_time = time_now ();
+	info->segment++;
+
+	return true;
+}
+
+/* Writes the buffers of a live capture in the order they were received,
+ * starting a new segment when the current one is large or old enough.
+ * An empty buffer holds the stream info to switch to when the header has
+ * changed.
+ */
+static void *
+live_write_thread (void *arg)
+{
+	live_info_t *info = arg;
+
+	print_set_tag ("writer");
+
+	while (1) {
+		buf_t *buf = get_dirty_buf ();
+
+		if (buf == NULL)
+			break;
+
+		if (buf->len == 0) {
+			live_close_segment (info);
+
+			free (info->stream->header);
+			memcpy (info->stream, buf->data, sizeof (stream_info_t));
+			info->packet_len = live_packet_len (info->stream);
+			info->prealloc = info->segment_size;
+
+			add_clean_buf (buf);
+			continue;
+		}
+
+		if (info->file != NULL &&
+		    info->bytes > info->stream->header_len &&
+		    ((info->segment_size > 0 && info->bytes + buf->len > info->segment_size) ||
+		     (info->segment_time > 0 && time_now () - info->start_time >= info->segment_time)))
+			live_close_segment (info);
+
+		/* Keep taking buffers after a failure, so the reader is not
+		 * blocked before it sees the capture has stopped
+		 */
+		if (!info->failed) {
+			if (info->file == NULL && !live_open_segment (info)) {
+				info->failed = true;
+				live_stop = 1;
+			} else if (fwrite (buf->data, 1, buf->len, info->file) != buf->len) {
+				live_write_failed (info, "Writing the segment", errno);
+			} else {
+				info->bytes += buf->len;
+			}
+		}
+
+		add_clean_buf (buf);
+	}
+
+	live_close_segment (info);
+
+	return NULL;
+}
+
+/* Interrupts the network read of a live capture when the capture is
+ * stopped or the stream has stalled. libmms has no read timeout, and a
+ * signal only interrupts a read in the thread it is delivered to.
+ */
+static void *
+live_watchdog_thread (void *arg)
+{
+	live_watchdog_t *watchdog = arg;
+
+	print_set_tag ("watchdog");
+
+	pthread_mutex_lock (&live_lock);
+
+	while (!watchdog->stop) {
+		struct timespec timeout;
+		uint64_t progress;
+		double now, elapsed;
+
+		clock_gettime (CLOCK_REALTIME, &timeout);
+		timeout.tv_sec++;
+		pthread_cond_timedwait (&live_cond, &live_lock, &timeout);
+
+		if (watchdog->stop)
+			break;
+
+		if (live_stop) {
+			pthread_kill (watchdog->reader, SIGALRM);
+			continue;
+		}
+
+		if (!watchdog->watching || watchdog->window == 0)
+			continue;
+
+		/* Keep interrupting until the reader gives up the connection */
+		if (atomic_load (&watchdog->stalled)) {
+			pthread_kill (watchdog->reader, SIGALRM);
+			continue;
+		}
+
+		now = time_now ();
+		progress = atomic_load (&watchdog->progress);
+		elapsed = now - watchdog->window_start;
+
+		if (elapsed < watchdog->window)
+			continue;
+
+		if (is_stalled (progress - watchdog->window_bytes, elapsed, watchdog->min_rate)) {
+			print_error ("The live stream has stalled, reconnecting\n");
+			atomic_store (&watchdog->stalled, true);
+			pthread_kill (watchdog->reader, SIGALRM);
+		}
+
+		watchdog->window_bytes = progress;
+		watchdog->window_start = now;
+	}
+
+	pthread_mutex_unlock (&live_lock);
+
+	return NULL;
+}
+
+/* Starts or stops watching the reads of a live capture */
+static void
+live_watch (live_watchdog_t *watchdog, bool watching)
+{
+	pthread_mutex_lock (&live_lock);
+
+	watchdog->watching = watching;
+	watchdog->window_bytes = atomic_load (&watchdog->progress);
+	watchdog->window_start = time_now ();
+	atomic_store (&watchdog->stalled, false);
+
+	pthread_mutex_unlock (&live_lock);
+}
+
+/* Reads len bytes from conn into data.
+ * Returns false if the stream ended, stalled or was stopped first.
+ */
+static bool
+live_read (mmsx_t *conn, char *data, uint32_t len, live_watchdog_t *watchdog)
+{
+	while (len > 0 && !live_stop && !atomic_load (&watchdog->stalled)) {
+		int bytes_read = mmsx_read (NULL, conn, data, len);
+
+		if (bytes_read <= 0)
+			return false;
+
+		data += bytes_read;
+		len  -= bytes_read;
+		atomic_fetch_add (&watchdog->progress, bytes_read);
+	}
+
+	return len == 0;
+}
+
+/* Reads the header a new connection starts with, and compares it with the
+ * header of the stream so far. If it has changed, the write thread is told
+ * to start a new segment with the new header.
+ * Returns false if the header could not be read.
+ */
+static bool
+live_read_header (mmsx_t *conn, stream_info_t *stream, live_watchdog_t *watchdog)
+{
+	uint32_t header_len = mmsx_get_asf_header_len (conn);
+	char *header = malloc (header_len);
+	buf_t *buf;
+
+	if (!live_read (conn, header, header_len, watchdog)) {
+		free (header);
+		return false;
+	}
+
+	if (header_len == stream->header_len &&
+	    memcmp (header, stream->header, header_len) == 0) {
+		free (header);
+		return true;
+	}
+
+	print_error ("The stream header has changed, starting a new segment\n");
+
+	/* The write thread owns the old header, and frees it */
+	stream->header     = header;
+	stream->header_len = header_len;
+
+	buf = get_clean_buf ();
+	buf->len = 0;
+	memcpy (buf->data, stream, sizeof (stream_info_t));
+	add_dirty_buf (buf);
+
+	return true;
+}
+
+/* Captures a live stream until it ends or the user interrupts it. The
+ * network is read here, while a separate thread writes the data, so a slow
+ * disk does not stall the stream. Dropped and stalled connections are
+ * reconnected, moving on to the next source after each failure.
+ */
+static bool
+live_capture (options_t *options, stream_info_t *stream)
+{
+	live_info_t info;
+	live_watchdog_t watchdog;
+	stream_info_t reader_stream = *stream;
+	struct sigaction action;
+	pthread_t thread, watchdog_tid;
+	uint32_t read_len;
+	uint64_t received = 0;
+	int failures = 0, current = 0;
+
+	memset (&info, 0, sizeof (info));
+	info.filename     = options->filename;
+	info.stream       = stream;
+	info.segment_size = (uint64_t)options->segment_size * 1024 * 1024;
+	info.segment_time = options->segment_time;
+	info.prealloc     = info.segment_size;
+
+	/* Read whole packets, so segments can be split between them */
+	info.packet_len = live_packet_len (stream);
+	read_len = info.packet_len > 0 ? info.packet_len : BUF_SIZE;
+
+	for (int i = 0; i < LIVE_BUF_COUNT; i++)
+		add_new_buf (&clean_bufs);
+
+	/* Without SA_RESTART, so the signals interrupt a blocked read */
+	memset (&action, 0, sizeof (action));
+	sigemptyset (&action.sa_mask);
+	action.sa_handler = live_interrupt;
+	sigaction (SIGINT, &action, NULL);
+	sigaction (SIGTERM, &action, NULL);
+	action.sa_handler = wake_up;
+	sigaction (SIGALRM, &action, NULL);
+
+	print_info (1, "Capturing live stream, press Ctrl-C to stop\n");
+
+	pthread_create (&thread, NULL, live_write_thread, &info);
+
+	memset (&watchdog, 0, sizeof (watchdog));
+	watchdog.reader   = pthread_self ();
+	watchdog.window   = options->stall_time;
+	watchdog.min_rate = options->stall_rate * 1024.0;
+	atomic_init (&watchdog.progress, 0);
+	atomic_init (&watchdog.stalled, false);
+	pthread_create (&watchdog_tid, NULL, live_watchdog_thread, &watchdog);
+
+	while (!live_stop && failures < LIVE_MAX_RECONNECTS) {
+		source_t *source = sources + current;
+		uint64_t conn_received = 0;
+		mmsx_t *conn;
+
+		if (failures > 0) {
+			print_info (1, "Reconnecting to %s\n", source->url);
+			sleep (LIVE_RECONNECT_DELAY << (failures - 1));
+
+			if (live_stop)
+				break;
+		}
+
+		/* A server that accepts the connection but never answers is
+		 * interrupted like a stalled one
+		 */
+		live_watch (&watchdog, true);
+
+		conn = mmsx_connect (NULL, NULL, source->url, options->bandwidth);
+
+		if (conn != NULL && live_read_header (conn, &reader_stream, &watchdog)) {
+			read_len = live_packet_len (&reader_stream);
+			if (read_len == 0)
+				read_len = BUF_SIZE;
+
+			while (1) {
+				buf_t *buf = get_clean_buf ();
+
+				if (!live_read (conn, buf->data, read_len, &watchdog)) {
+					add_clean_buf (buf);
+					break;
+				}
+
+				buf->off = received;
+				buf->len = read_len;
+
+				received += read_len;
+				conn_received += read_len;
+
+				add_dirty_buf (buf);
+			}
+		}
+
+		live_watch (&watchdog, false);
+
+		if (conn == NULL) {
+			print_error ("Could not open %s\n", source->url);
+		} else {
+			mmsx_close (conn);
+
+			if (!live_stop)
+				print_error ("Lost connection to %s\n", source->url);
+		}
+
+		if (conn_received > 0)
+			failures = 0;
+
+		if (!live_stop) {
+			failures++;
+			current = (current + 1) % source_count;
+		}
+	}
+
+	if (failures >= LIVE_MAX_RECONNECTS)
+		print_error ("Giving up after %i failed connections\n", failures);
+
+	pthread_mutex_lock (&live_lock);
+	watchdog.stop = true;
+	pthread_cond_signal (&live_cond);
+	pthread_mutex_unlock (&live_lock);
+	pthread_join (watchdog_tid, NULL);
+
+	fifo_signal (&dirty_bufs);
+	pthread_join (thread, NULL);
+
+	print_info (1, "Captured %" PRIu64 " bytes in %i files\n", received, info.segment);
+
+	return received > 0 && !info.failed;
+}
+
+/* Fills in the packets the write thread could not index, appends a simple
+ * index object to the end of the stream, and updates the file size in the
+ * header.
+ * Returns the index object, which must be freed, or NULL on error.
+ */
+static char *
+write_index (int fd, asf_index_t *index, uint32_t len, uint32_t *index_len)
+{
+	char packet_header[ASF_PACKET_HEADER_MAX];
+	uint32_t packet = 0, off;
+	char *obj, *header, *old_header;
+	bool updated = false;
+
+	while (asf_index_missing (index, &packet, &off)) {
+		uint32_t send_time;
+		ssize_t n = pread (fd, packet_header, sizeof (packet_header), off);
+
+		if (n < 0) {
+			print_error ("Could not read the packet at %u - %s\n", off, strerror (errno));
+			return NULL;
+		}
+
+		if (asf_packet_time (packet_header, n, &send_time))
+			asf_index_set (index, packet, send_time);
+
+		packet++;
+	}
+
+	if (!(obj = asf_index_build (index, index_len))) {
+		print_error ("Could not build the index\n");
+		return NULL;
+	}
+
+	if (pwrite (fd, obj, *index_len, len) != *index_len) {
+		print_error ("Could not write the index - %s\n", strerror (errno));
+		free (obj);
+		return NULL;
+	}
+
+	header     = malloc (index->data_offset);
+	old_header = malloc (index->data_offset);
+
+	if (pread (fd, old_header, index->data_offset, 0) == index->data_offset) {
+		memcpy (header, old_header, index->data_offset);
+
+		if (asf_header_set_size (header, index->data_offset, (uint64_t)len + *index_len) &&
+		    pwrite (fd, header, index->data_offset, 0) == index->data_offset)
+			updated = true;
+	}
+
+	if (!updated) {
+		print_error ("Could not update the file size in the header\n");
+		free (old_header);
+		free (header);
+		free (obj);
+		return NULL;
+	}
+
+	/* The checksums of the ranges holding the header have changed too */
+	for (int i = 0; i < info_count; i++) {
+		download_info_t *info = infos[i];
+		uint32_t start = info->range_start;
+		uint32_t end   = start + info->range_len;
+
+		if (!info->checksum || start >= index->data_offset)
+			continue;
+
+		if (end > index->data_offset)
+			end = index->data_offset;
+
+		info->crc = crc32c_patch (info->crc, info->range_len, 0,
+				old_header + start, header + start, end - start);
+	}
+
+	free (old_header);
+	free (header);
+
+	print_info (2, "Wrote a %u byte index\n", *index_len);
+
+	return obj;
+}
+
+static int
+compare_ranges (const void *a, const void *b)
+{
+	const download_info_t *info_a = *(download_info_t * const *)a;
+	const download_info_t *info_b = *(download_info_t * const *)b;
+
+	return info_a->range_start < info_b->range_start ? -1 :
+	       info_a->range_start > info_b->range_start;
+}
+
+/* Writes the CRC32C of each range and of the index (if any), followed by
+ * the CRC32C of the whole file, to FILENAME.crc32c. The ranges must be
+ * finished.
+ */
+static bool
+write_checksums (const char *filename, const char *index, uint32_t index_len)
+{
+	char sidecar[strlen (filename) + sizeof (".crc32c")];
+	uint32_t crc = 0;
+	uint64_t len = 0;
+	FILE *file;
+
+	sprintf (sidecar, "%s.crc32c", filename);
+
+	if (!(file = fopen (sidecar, "w"))) {
+		print_error ("Could not open %s - %s\n", sidecar, strerror (errno));
+		return false;
+	}
+
+	/* Split ranges were added at the end */
+	qsort (infos, info_count, sizeof (download_info_t *), compare_ranges);
+
+	for (int i = 0; i < info_count; i++) {
+		fprintf (file, "range %u %u %08x\n",
+				infos[i]->range_start, infos[i]->range_len, infos[i]->crc);
+
+		crc = crc32c_combine (crc, infos[i]->crc, infos[i]->range_len);
+		len += infos[i]->range_len;
+	}
+
+	if (index != NULL) {
+		uint32_t index_crc = crc32c_update (0, index, index_len);
+
+		fprintf (file, "index %" PRIu64 " %u %08x\n", len, index_len, index_crc);
+
+		crc = crc32c_combine (crc, index_crc, index_len);
+		len += index_len;
+	}
+
+	fprintf (file, "%08x %" PRIu64 " %s\n", crc, len, filename);
+
+	if (fclose (file)) {
+		print_error ("Could not write %s - %s\n", sidecar, strerror (errno));
+		return false;
+	}
+
+	print_info (1, "CRC32C: %08x\n", crc);
+
+	return true;
+}
+
+/* Copies a range found in the cache into the file. The data does not pass
+ * through the download and write threads, so it is read back once here to
+ * checksum and index it. Returns false if the range has to be downloaded.
+ */
+static bool
+read_cached (cache_t *cache, int fd, download_info_t *info, asf_index_t *index)
+{
+	static char cache_buf[BUF_SIZE];
+	uint32_t chunk = BUF_SIZE;
+
+	if (!cache_read (cache, fd, info->start, info->len))
+		return false;
+
+	/* Read whole packets, so the index gets all of them */
+	if (info->packet_len > 0 && info->packet_len <= BUF_SIZE)
+		chunk = BUF_SIZE / info->packet_len * info->packet_len;
+
+	for (uint32_t off = 0; (info->checksum || index) && off < info->len; ) {
+		uint32_t left = info->len - off;
+		ssize_t n = pread (fd, cache_buf, left < chunk ? left : chunk, info->start + off);
+
+		if (n <= 0) {
+			print_error ("Could not read %s - %s\n", "the cached data",
+					n < 0 ? strerror (errno) : "end of file");
+			info->crc = 0;
+			return false;
+		}
+
+		if (info->checksum)
+			info->crc = crc32c_update (info->crc, cache_buf, n);
+
+		if (index)
+			asf_index_add (index, info->start + off, cache_buf, n);
+
+		off += n;
+	}
+
+	info->start   += info->len;
+	info->len      = 0;
+	info->finished = true;
+
+	return true;
+}
+
+/* Rounds off up or down to first + n * unit. Offsets before first are
+ * left as they are.
+ */
+static uint32_t
+align_offset (uint32_t off, uint32_t first, uint32_t unit, bool up)
+{
+	if (off <= first)
+		return off;
+
+	return first + ((uint64_t)off - first + (up ? unit - 1 : 0)) / unit * unit;
+}
+
+/* Adds ranges of about piece_len bytes covering start to end */
+static void
+plan_gap (uint32_t start, uint32_t end, uint32_t piece_len,
+          uint32_t first, uint32_t unit)
+{
+	while (end - start > piece_len) {
+		uint32_t split = align_offset (start + piece_len, first, unit, true);
+
+		if (split >= end)
+			break;
+
+		download_add (start, split - start);
+		start = split;
+	}
+
+	download_add (start, end - start);
+}
+
+/* Splits the stream into ranges. The parts found in the cache get a range
+ * each, marked as cached, and the rest of the stream is split into about
+ * one range per thread. The ranges (except the start of the first one)
+ * begin at first + n * unit, so cached data that does not cover a whole
+ * unit is downloaded again. Returns the number of cached bytes.
+ */
+static uint32_t
+plan_ranges (cache_t *cache, int thread_count, uint32_t len,
+             uint32_t first, uint32_t unit)
+{
+	cache_range_t cached[cache ? cache->range_count + 1 : 1];
+	int cached_count = 0;
+	uint32_t pos = 0, gap_len = 0, piece_len, cached_len = 0;
+
+	for (int i = 0; cache != NULL && i < cache->range_count; i++) {
+		uint32_t start = align_offset (cache->ranges[i].start, first, unit, true);
+		uint32_t end = cache->ranges[i].end;
+
+		if (end < len)
+			end = align_offset (end, first, unit, false);
+
+		if (start >= end)
+			continue;
+
+		cached[cached_count].start = start;
+		cached[cached_count].end   = end;
+		cached_count++;
+
+		gap_len += start - pos;
+		pos = end;
+	}
+
+	gap_len += len - pos;
+
+	/* The end marks the last gap */
+	cached[cached_count].start = len;
+	cached[cached_count].end   = len;
+
+	piece_len = (gap_len + (thread_count - 1)) / thread_count;
+	piece_len = (piece_len + (unit - 1)) / unit * unit;
+
+	if (piece_len == 0)
+		piece_len = unit;
+
+	pos = 0;
+
+	for (int i = 0; i <= cached_count; i++) {
+		if (cached[i].start > pos)
+			plan_gap (pos, cached[i].start, piece_len, first, unit);
+
+		if (cached[i].end > cached[i].start) {
+			download_add (cached[i].start, cached[i].end - cached[i].start)->cached = true;
+			cached_len += cached[i].end - cached[i].start;
+		}
+
+		pos = cached[i].end;
+	}
+
+	return cached_len;
+}
+
+static bool
+download (options_t *options)
+{
+	output_t output;
+	uint32_t len;
+	stream_info_t stream;
+	asf_header_t asf;
+	asf_index_t index;
+	char *index_obj = NULL;
+	uint32_t index_len = 0;
+	bool indexing = false;
+	cache_t cache;
+	bool caching = false;
+	uint32_t cached = 0;
+	int thread_count = options->thread_count;
+	pthread_t write_tid;
+	write_info_t write_info;
+	watchdog_t watchdog;
+	pthread_t watchdog_tid;
+	int active = 0, next = 0, planned, pending = 0;
+	bool success = true, write_failed;
+	cpu_list_t download_cpus, writer_cpus;
+
+	if (options->download_cpus != NULL &&
+	    !affinity_parse (options->download_cpus, &download_cpus)) {
+		print_error ("Invalid CPU list %s\n", options->download_cpus);
+		return false;
+	}
+
+	if (options->writer_cpus != NULL &&
+	    !affinity_parse (options->writer_cpus, &writer_cpus)) {
+		print_error ("Invalid CPU list %s\n", options->writer_cpus);
+		return false;
+	}
+
+	/* Without pinning, the download threads share one pool of buffers */
+	if (options->download_cpus == NULL) {
+		for (int i = 0; i < BUFS_PER_THREAD * thread_count; i++)
+			add_new_buf (&clean_bufs);
+	}
+
+	fifo_set_spin (&dirty_bufs, options->spin);
+
+	if (!sources_init (options, &stream))
+		return false;
+
+	if (!stream.seekable)
+		return live_capture (options, &stream);
+
+	len = stream.len;
+
+	if (max_connections > 0 && thread_count > max_connections * source_count) {
+		thread_count = max_connections * source_count;
+	}
+
+	if (!output_open (&output, options->filename, len, options->write_policy))
+		return false;
+
+	if (options->cache_dir != NULL)
+		caching = cache_open (&cache, options->cache_dir,
+				(uint64_t)options->cache_size * 1024 * 1024,
+				len, stream.header, stream.header_len);
+
+	/* Align the ranges to the data packets if the header can be parsed */
+	if (asf_header_parse (stream.header, stream.header_len, &asf) &&
+	    asf.data_offset == stream.header_len && len > asf.data_offset) {
+		print_info (2, "Packet size:     %u bytes\n", asf.packet_len);
+		cached = plan_ranges (caching ? &cache : NULL, thread_count, len,
+				asf.data_offset, asf.packet_len);
+
+		if (options->index)
+			indexing = asf_index_init (&index, &asf, len);
+	} else {
+		print_info (2, "Could not parse the ASF header, ranges are not aligned\n");
+		asf.data_offset = 0;
+		asf.packet_len  = 0;
+		cached = plan_ranges (caching ? &cache : NULL, thread_count, len, 0, 1);
+	}
+
+	/* Fill in the info structures for the download threads, and copy the
+	 * cached ranges
+	 */
+	for (int i = 0; i < info_count; i++) {
+		download_info_t *info = infos[i];
+
+		info->bandwidth   = options->bandwidth;
+		info->checksum    = options->checksum;
+		info->data_offset = asf.data_offset;
+		info->packet_len  = asf.packet_len;
+		info->cpus        = options->download_cpus ? &download_cpus : NULL;
+
+		if (info->cached &&
+		    !read_cached (&cache, output.fd, info, indexing ? &index : NULL))
+			cached -= info->len;
+	}
+
+	planned = info_count;
+
+	for (int i = 0; i < planned; i++) {
+		if (!infos[i]->finished)
+			pending++;
+	}
+
+	if (pending < thread_count)
+		thread_count = pending;
+
+	print_info (1, "Starting download\nUsing %i threads and %i sources\n",
+	               thread_count, source_count);
+
+	if (cached > 0)
+		print_info (1, "Found %u bytes in the cache\n", cached);
+
+	/* Create the thread that writes the data to file */
+	write_info.output = &output;
+	write_info.len  = len;
+	write_info.cached = cached;
+	write_info.filename     = options->filename;
+	write_info.progress_bar = options->progress_bar;
+	write_info.index        = indexing ? &index : NULL;
+	write_info.cpus         = options->writer_cpus ? &writer_cpus : NULL;
+	write_info.failed       = false;
+	pthread_create (&write_tid, NULL, write_thread, &write_info);
+
+	/* Start a thread for each of the first ranges that are not cached, the
+	 * rest are started as threads finish
+	 */
+	for (; next < planned && active < thread_count; next++) {
+		download_info_t *info = infos[next];
+
+		if (!info->finished) {
+			info->index = active;
+			download_start (info);
+			active++;
+		}
+	}
+
+	if (options->stall_time > 0) {
+		struct sigaction action;
+
+		/* Without SA_RESTART, so the signal interrupts a connect */
+		memset (&action, 0, sizeof (action));
+		sigemptyset (&action.sa_mask);
+		action.sa_handler = wake_up;
+		sigaction (SIGALRM, &action, NULL);
+
+		watchdog.window   = options->stall_time;
+		watchdog.min_rate = options->stall_rate * 1024.0;
+		watchdog.stop     = false;
+		pthread_create (&watchdog_tid, NULL, watchdog_thread, &watchdog);
+	}
+
+	/* Wait for the download threads, and restart the ranges that did not
+	 * finish as soon as their thread exits. A thread that finishes starts
+	 * the next range, or takes over the end of the slowest one.
+	 */
+	while (active > 0) {
+		download_info_t *info = fifo_pop (&done_infos);
+
+		pthread_join (info->thread, NULL);
+		active--;
+
+		if (!success)
+			continue;
+
+		if (info->finished) {
+			download_info_t *split;
+
+			while (next < planned && infos[next]->finished)
+				next++;
+
+			if (next < planned) {
+				split = infos[next++];
+			} else {
+				split = download_split (info);
+			}
+
+			if (split != NULL) {
+				split->index = info->index;
+				download_start (split);
+				active++;
+			}
+			continue;
+		}
+
+		/* Wait for a free slot if the source refused the connection */
+		if (atomic_load (&info->received) > 0 || info->throttled)
+			info->retries = 0;
+
+		if (sources_dead () || ++info->retries > MAX_RANGE_RETRIES) {
+			print_error ("Could not download %u bytes at %u\n", info->len, info->start);
+			success = false;
+			continue;
+		}
+
+		print_info (1, "Restarting the download of %u bytes at %u\n",
+		               info->len, info->start);
+		download_start (info);
+		active++;
+	}
+
+	if (options->stall_time > 0) {
+		pthread_mutex_lock (&infos_lock);
+		watchdog.stop = true;
+		pthread_cond_signal (&watchdog_cond);
+		pthread_mutex_unlock (&infos_lock);
+		pthread_join (watchdog_tid, NULL);
+	}
+
+	/* Wait for the write thread to write all the dirty data */
+	fifo_signal (&dirty_bufs);
+	pthread_join (write_tid, NULL);
+
+	write_failed = write_info.failed;
+
+	if (!output_flush (&output)) {
+		print_error ("Could not write to %s - %s\n", options->filename, strerror (errno));
+		write_failed = true;
+	}
+
+	if (write_failed)
+		success = false;
+
+	/* Keep what was downloaded, even if the download failed, unless some
+	 * of it could not be written
+	 */
+	if (caching) {
+		for (int i = 0; !write_failed && i < info_count; i++) {
+			download_info_t *info = infos[i];
+
+			cache_store (&cache, output.fd, info->range_start,
+					info->start - info->range_start);
+		}
+
+		cache_close (&cache);
+	}
+
+	/* The cache keeps the stream as it was sent, without the index */
+	if (success && indexing &&
+	    !(index_obj = write_index (output.fd, &index, len, &index_len)))
+		success = false;
+
+	if (indexing)
+		asf_index_free (&index);
+
+	output_close (&output);
+
+	if (success)
+		print_info (1, "\nDownload complete\n");
+
+	if (success && options->checksum)
+		success = write_checksums (options->filename, index_obj, index_len);
+
+	free (index_obj);
+
+	return success;
+}
+
+int
+main (int argc, char *argv[])
+{
+	options_t options;
+
+	if (!options_parse (argc, argv, &options))
+		return 1;
+
+	print_set_verbosity_level (options.verbosity_level);
+	print_init ();
+	atexit (print_shutdown);
+
 	if (!download (&options))
 		return 1;
 
@@ -25,23 +25,38 @@
 #include <limits.h>
 #include <stdio.h>
 
-const char *short_options = "hVvbpf:t:B:";
+const char *short_options = "hVvbpCIf:t:c:B:s:S:k:K:w:r:W:a:A:P:";
 static struct option long_options[] = {
 	{"help",      no_argument,       0, 'h'},
 	{"version",   no_argument,       0, 'V'},
 	{"verbose",   no_argument,       0, 'v'},
 	{"brief",     no_argument,       0, 'b'},
 	{"progress",  no_argument,       0, 'p'},
+	{"checksum",  no_argument,       0, 'C'},
+	{"no-index",  no_argument,       0, 'I'},
 	{"file",      required_argument, 0, 'f'},
 	{"threads",   required_argument, 0, 't'},
+	{"connections", required_argument, 0, 'c'},
 	{"bandwidth", required_argument, 0, 'B'},
+	{"segment-time", required_argument, 0, 's'},
+	{"segment-size", required_argument, 0, 'S'},
+	{"cache",     required_argument, 0, 'k'},
+	{"cache-size", required_argument, 0, 'K'},
+	{"stall-time", required_argument, 0, 'w'},
+	{"stall-rate", required_argument, 0, 'r'},
+	{"write-policy", required_argument, 0, 'W'},
+	{"download-cpus", required_argument, 0, 'a'},
+	{"writer-cpus", required_argument, 0, 'A'},
+	{"spin",      required_argument, 0, 'P'},
 };
 
 static void
 print_usage (const char *prog)
 {
-	printf ("Usage: %s [OPTIONS] URL\n"
+	printf ("Usage: %s [OPTIONS] URL [MIRROR-URL...]\n"
 			"Downloads the stream given by the URL (must be mms:// or mmsh://)\n"
+			"If more URLs are given, they must point to the same stream, and\n"
+			"the download is spread over all of them\n"
 			"If no filename is specified, the filename in the URL will be used\n\n"
 			"Options:\n"
 			"  -h --help        show this help and exit\n"
@@ -49,9 +64,29 @@ print_usage (const char *prog)
 			"  -v --verbose     increase the verbosity level\n"
 			"  -b --brief       descrease the verbosity level\n"
 			"  -p --progress    show a progress bar\n"
+			"  -C --checksum    write CRC32C checksums to FILE.crc32c\n"
+			"  -I --no-index    do not append an ASF index to the file\n"
 			"  -f --file        the file to save to\n"
 			"  -t --threads     the number of threads to use\n"
-			"  -B --bandwidth   the bandwidth to use per thread (in KiB/s)\n",
+			"  -c --connections the maximum number of connections per server\n"
+			"  -B --bandwidth   the bandwidth to use per thread (in KiB/s)\n"
+			"  -k --cache       keep downloaded data in this directory, and reuse it\n"
+			"  -K --cache-size  the maximum size of the cache (in MiB, default 4096)\n"
+			"  -w --stall-time  restart connections that are slower than the stall\n"
+			"                   rate for this many seconds (default 30, 0 to disable)\n"
+			"  -r --stall-rate  the stall rate (in KiB/s, default 0: only connections\n"
+			"                   that get no data at all are stalled)\n"
+			"  -W --write-policy how to write the file: buffered (default), dontneed\n"
+			"                   (keep it out of the page cache) or direct (O_DIRECT)\n"
+			"  -a --download-cpus pin the download threads to these CPUs (e.g. 0-3,8),\n"
+			"                   one CPU each, with their buffers allocated locally\n"
+			"  -A --writer-cpus pin the write thread to these CPUs\n"
+			"  -P --spin        spin up to this many times waiting for data before\n"
+			"                   the write thread sleeps\n\n"
+			"Live streams are captured until they end or mmsget is interrupted.\n"
+			"The capture can be split into numbered files with:\n"
+			"  -s --segment-time start a new file after this many seconds\n"
+			"  -S --segment-size start a new file after this many MiB\n",
 			prog
 		   );
 }
@@ -91,11 +126,26 @@ options_parse (int argc, char *argv[], options_t *options)
 
 	/* Set default options */
 	options->url = NULL;
+	options->urls = NULL;
+	options->url_count = 0;
 	options->filename = NULL;
 	options->thread_count = 10;
+	options->connections_per_source = 0;
 	options->bandwidth = INT_MAX;
+	options->segment_time = 0;
+	options->segment_size = 0;
+	options->cache_dir = NULL;
+	options->cache_size = 4096;
+	options->stall_time = 30;
+	options->stall_rate = 0;
+	options->write_policy = WRITE_BUFFERED;
+	options->download_cpus = NULL;
+	options->writer_cpus = NULL;
+	options->spin = 0;
 	options->verbosity_level = 1;
 	options->progress_bar = false;
+	options->checksum = false;
+	options->index = true;
 
 	/* Parse commandline arguments */
 	while ((c = getopt_long (argc, argv, short_options, long_options, NULL)) != -1) {
@@ -120,6 +170,14 @@ options_parse (int argc, char *argv[], options_t *options)
 			options->progress_bar = true;
 			break;
 
+		case 'C':
+			options->checksum = true;
+			break;
+
+		case 'I':
+			options->index = false;
+			break;
+
 		case 'f':
 			options->filename = strdup (optarg);
 			break;
@@ -129,11 +187,72 @@ options_parse (int argc, char *argv[], options_t *options)
 				return false;
 			break;
 
+		case 'c':
+			if (!str_to_int (optarg, &options->connections_per_source))
+				return false;
+			break;
+
 		case 'B':
 			if (!str_to_int (optarg, &options->bandwidth))
 				return false;
 			break;
 
+		case 's':
+			if (!str_to_int (optarg, &options->segment_time))
+				return false;
+			break;
+
+		case 'S':
+			if (!str_to_int (optarg, &options->segment_size))
+				return false;
+			break;
+
+		case 'k':
+			options->cache_dir = optarg;
+			break;
+
+		case 'K':
+			if (!str_to_int (optarg, &options->cache_size))
+				return false;
+			break;
+
+		case 'w':
+			if (!str_to_int (optarg, &options->stall_time))
+				return false;
+			break;
+
+		case 'r':
+			if (!str_to_int (optarg, &options->stall_rate))
+				return false;
+			break;
+
+		case 'W':
+			if (!output_parse_policy (optarg, &options->write_policy)) {
+				fprintf (stderr, "%s: Unknown write policy %s\n", argv[0], optarg);
+				return false;
+			}
+			break;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		case 'a':
+			options->download_cpus = optarg;
+			break;
+
+		case 'A':
+			options->writer_cpus = optarg;
+			break;
+#else
+		case 'a':
+		case 'A':
+			fprintf (stderr, "%s: CPU pinning is not supported on this system\n", argv[0]);
+			return false;
+#endif
+
+		case 'P':
+			if (!str_to_int (optarg, &options->spin))
+				return false;
+			break;
+
 		default:
 			break;
 		}
@@ -146,6 +265,8 @@ options_parse (int argc, char *argv[], options_t *options)
 	}
 
 	options->url = argv[optind];
+	options->urls = (const char **)argv + optind;
+	options->url_count = argc - optind;
 
 	if (options->filename == NULL)
 		options->filename = get_filename (options->url);
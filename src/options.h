@@ -21,14 +21,30 @@
 #define _OPTIONS_H_
 
 #include <stdbool.h>
+#include "output.h"
 
 typedef struct {
 	const char *filename;
 	const char *url;
+	const char **urls;
+	int url_count;
 	int thread_count;
+	int connections_per_source;
 	int bandwidth;
+	int segment_time;
+	int segment_size;
+	const char *cache_dir;
+	int cache_size;
+	int stall_time;
+	int stall_rate;
+	write_policy_t write_policy;
+	const char *download_cpus;
+	const char *writer_cpus;
+	int spin;
 	int verbosity_level;
 	bool progress_bar;
+	bool checksum;
+	bool index;
 } options_t;
 
 bool options_parse (int argc, char *argv[], options_t *options);
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "output.h"
+#include "print.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* WRITE_DONTNEED: how much to write between each writeback */
+#define SYNC_INTERVAL (8 * 1024 * 1024)
+
+/* WRITE_DIRECT: data is gathered in aligned chunks of this size, which are
+ * written when they have been filled.
+ */
+#define DIRECT_CHUNK_SIZE (1024 * 1024)
+#define DIRECT_ALIGN      4096
+
+/* Number of separate pieces of data a chunk can hold. There is normally
+ * only one, or two where one range ends and the next starts.
+ */
+#define DIRECT_MAX_EXTENTS 8
+
+struct direct_chunk_St {
+	uint32_t off;
+	uint32_t filled;
+	char *data;
+
+	/* The parts of the chunk that hold data, relative to off */
+	struct {
+		uint32_t start, end;
+	} extents[DIRECT_MAX_EXTENTS];
+	int extent_count;
+
+	direct_chunk_t *next;
+};
+
+bool
+output_parse_policy (const char *str, write_policy_t *policy)
+{
+	if (!strcmp (str, "buffered")) {
+		*policy = WRITE_BUFFERED;
+	} else if (!strcmp (str, "dontneed")) {
+		*policy = WRITE_DONTNEED;
+	} else if (!strcmp (str, "direct")) {
+		*policy = WRITE_DIRECT;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+write_all (int fd, const char *data, uint32_t len, uint32_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite (fd, data, len, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		data += n;
+		len  -= n;
+		off  += n;
+	}
+
+	return true;
+}
+
+/* Opens the file and reserves space for len bytes.
+ * Returns false on error.
+ */
+bool
+output_open (output_t *out, const char *filename, uint32_t len, write_policy_t policy)
+{
+	memset (out, 0, sizeof (output_t));
+	out->policy = policy;
+	out->len = len;
+	out->direct_fd = -1;
+
+	if ((out->fd = open (filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		print_error ("Could not open %s - %s\n", filename, strerror (errno));
+		return false;
+	}
+
+	/* Allocate the blocks up front, so the file is not fragmented by the
+	 * ranges being written in parallel.
+	 */
+#ifdef HAVE_FALLOCATE
+	if (fallocate (out->fd, 0, 0, len) == 0)
+		goto allocated;
+#endif
+	if (ftruncate (out->fd, len)) {
+		print_error ("ftruncate failed %s\n", strerror (errno));
+		close (out->fd);
+		return false;
+	}
+
+#ifdef HAVE_FALLOCATE
+allocated:
+#endif
+	if (policy == WRITE_DIRECT) {
+#ifdef O_DIRECT
+		out->direct_fd = open (filename, O_WRONLY | O_DIRECT);
+#endif
+		if (out->direct_fd < 0) {
+			print_error ("Could not open %s for direct I/O, using dontneed\n", filename);
+			out->policy = WRITE_DONTNEED;
+		}
+	}
+
+	return true;
+}
+
+/* Starts writing back the dirty pages, and drops the pages written back
+ * since the last time from the page cache.
+ */
+static void
+writeback (output_t *out)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range (out->fd, 0, 0,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise (out->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	out->unsynced = 0;
+}
+
+static uint32_t
+chunk_len (output_t *out, direct_chunk_t *chunk)
+{
+	uint32_t left = out->len - chunk->off;
+
+	return left < DIRECT_CHUNK_SIZE ? left : DIRECT_CHUNK_SIZE;
+}
+
+/* Writes the parts of a chunk that hold data through the page cache, and
+ * frees the chunk.
+ */
+static bool
+chunk_flush (output_t *out, direct_chunk_t *chunk)
+{
+	bool ret = true;
+
+	for (int i = 0; i < chunk->extent_count; i++) {
+		uint32_t start = chunk->extents[i].start;
+		uint32_t end   = chunk->extents[i].end;
+
+		if (!write_all (out->fd, chunk->data + start, end - start, chunk->off + start))
+			ret = false;
+	}
+
+	chunk->next = out->free_chunks;
+	out->free_chunks = chunk;
+
+	return ret;
+}
+
+static direct_chunk_t *
+chunk_get (output_t *out, uint32_t off)
+{
+	direct_chunk_t *chunk;
+
+	for (chunk = out->chunks; chunk != NULL; chunk = chunk->next) {
+		if (chunk->off == off)
+			return chunk;
+	}
+
+	if (out->free_chunks != NULL) {
+		chunk = out->free_chunks;
+		out->free_chunks = chunk->next;
+	} else {
+		chunk = malloc (sizeof (direct_chunk_t));
+
+		if (posix_memalign ((void **)&chunk->data, DIRECT_ALIGN, DIRECT_CHUNK_SIZE)) {
+			free (chunk);
+			return NULL;
+		}
+	}
+
+	chunk->off = off;
+	chunk->filled = 0;
+	chunk->extent_count = 0;
+	chunk->next = out->chunks;
+	out->chunks = chunk;
+
+	return chunk;
+}
+
+static void
+chunk_remove (output_t *out, direct_chunk_t *chunk)
+{
+	direct_chunk_t **p;
+
+	for (p = &out->chunks; *p != chunk; p = &(*p)->next);
+
+	*p = chunk->next;
+}
+
+/* Copies data into a chunk, and writes the chunk with O_DIRECT once it
+ * has been filled.
+ */
+static bool
+chunk_write (output_t *out, const char *data, uint32_t len, uint32_t off)
+{
+	direct_chunk_t *chunk = chunk_get (out, off - off % DIRECT_CHUNK_SIZE);
+	uint32_t start, end;
+	int i;
+
+	if (chunk == NULL)
+		return write_all (out->fd, data, len, off);
+
+	start = off - chunk->off;
+	end   = start + len;
+
+	memcpy (chunk->data + start, data, len);
+	chunk->filled += len;
+
+	/* Add the extent, joining it with the ones it touches */
+	for (i = 0; i < chunk->extent_count; i++) {
+		if (chunk->extents[i].end == start) {
+			chunk->extents[i].end = end;
+			break;
+		} else if (chunk->extents[i].start == end) {
+			chunk->extents[i].start = start;
+			break;
+		}
+	}
+
+	if (i == chunk->extent_count) {
+		if (i == DIRECT_MAX_EXTENTS) {
+			/* Too fragmented, fall back to buffered writes */
+			chunk_remove (out, chunk);
+			return chunk_flush (out, chunk) && write_all (out->fd, data, len, off);
+		}
+
+		chunk->extents[i].start = start;
+		chunk->extents[i].end   = end;
+		chunk->extent_count++;
+	}
+
+	/* Only whole, aligned chunks can be written directly. The last chunk
+	 * of the file is written by output_flush.
+	 */
+	if (chunk->filled == DIRECT_CHUNK_SIZE && chunk_len (out, chunk) == DIRECT_CHUNK_SIZE) {
+		chunk_remove (out, chunk);
+
+		/* If the direct write fails, the chunk is written through the
+		 * page cache instead. Some file systems accept O_DIRECT in open
+		 * but not in write, then the other chunks are written that way too.
+		 */
+		if (write_all (out->direct_fd, chunk->data, DIRECT_CHUNK_SIZE, chunk->off)) {
+			chunk->extent_count = 0;
+		} else if (errno == EINVAL) {
+			print_error ("Direct I/O is not supported, using dontneed\n");
+			out->policy = WRITE_DONTNEED;
+		}
+
+		return chunk_flush (out, chunk);
+	}
+
+	return true;
+}
+
+/* Writes len bytes of data at off, following the write policy.
+ * Returns false on error.
+ */
+bool
+output_write (output_t *out, const char *data, uint32_t len, uint32_t off)
+{
+	bool ret = true;
+
+	switch (out->policy) {
+	case WRITE_BUFFERED:
+		return write_all (out->fd, data, len, off);
+
+	case WRITE_DONTNEED:
+		ret = write_all (out->fd, data, len, off);
+
+		out->unsynced += len;
+		if (out->unsynced >= SYNC_INTERVAL)
+			writeback (out);
+
+		return ret;
+
+	case WRITE_DIRECT:
+		/* Split the data at the chunk boundaries */
+		while (len > 0) {
+			uint32_t left = DIRECT_CHUNK_SIZE - off % DIRECT_CHUNK_SIZE;
+			uint32_t n = len < left ? len : left;
+
+			if (!chunk_write (out, data, n, off))
+				ret = false;
+
+			data += n;
+			len  -= n;
+			off  += n;
+		}
+
+		return ret;
+	}
+
+	return false;
+}
+
+/* Writes out the data still held in chunks, so the file can be read.
+ * Returns false on error.
+ */
+bool
+output_flush (output_t *out)
+{
+	bool ret = true;
+
+	while (out->chunks != NULL) {
+		direct_chunk_t *chunk = out->chunks;
+
+		out->chunks = chunk->next;
+
+		if (!chunk_flush (out, chunk))
+			ret = false;
+	}
+
+	if (out->policy == WRITE_DONTNEED)
+		writeback (out);
+
+	return ret;
+}
+
+void
+output_close (output_t *out)
+{
+	output_flush (out);
+
+	while (out->free_chunks != NULL) {
+		direct_chunk_t *chunk = out->free_chunks;
+
+		out->free_chunks = chunk->next;
+		free (chunk->data);
+		free (chunk);
+	}
+
+	if (out->direct_fd >= 0)
+		close (out->direct_fd);
+
+	close (out->fd);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2011 Sivert Berg <sivertb@stud.ntnu.no>
+ *
+ * This file is part of mmsget - a threaded mms-stream downloader
+ *
+ * mmsget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mmsget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mmsget.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+	/* Plain writes through the page cache */
+	WRITE_BUFFERED,
+	/* Writes through the page cache, dropping the written pages as they
+	 * reach the disk */
+	WRITE_DONTNEED,
+	/* Writes bypassing the page cache with O_DIRECT */
+	WRITE_DIRECT
+} write_policy_t;
+
+typedef struct direct_chunk_St direct_chunk_t;
+
+/* The file a download is saved to */
+typedef struct {
+	write_policy_t policy;
+	uint32_t len;
+
+	/* Used for all buffered writes and reads */
+	int fd;
+
+	/* WRITE_DONTNEED: bytes written since the last writeback */
+	uint64_t unsynced;
+
+	/* WRITE_DIRECT: opened with O_DIRECT, and the chunks being filled */
+	int direct_fd;
+	direct_chunk_t *chunks;
+	direct_chunk_t *free_chunks;
+} output_t;
+
+bool output_parse_policy (const char *str, write_policy_t *policy);
+bool output_open  (output_t *out, const char *filename, uint32_t len, write_policy_t policy);
+bool output_write (output_t *out, const char *data, uint32_t len, uint32_t off);
+bool output_flush (output_t *out);
+void output_close (output_t *out);
+
+#endif /* _OUTPUT_H_ */
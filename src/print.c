@@ -19,18 +19,72 @@
 
 #include "print.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 
 /* Update the progress bar at most twice a second */
 #define PROGRESS_BAR_UPDATE_SPEED 0.5
 
+/* Messages each thread can queue before it has to wait for the log thread,
+ * must be a power of two.
+ */
+#define LOG_RING_SIZE 128
+#define LOG_MSG_SIZE  512
+#define LOG_TAG_SIZE  32
+
+/* How often the log thread looks for new messages, in milliseconds */
+#define LOG_POLL_INTERVAL 10
+
+typedef enum {
+	LOG_INFO,
+	LOG_ERROR,
+	LOG_PROGRESS
+} log_kind_t;
+
+typedef struct {
+	struct timespec time;
+	log_kind_t kind;
+	char tag[LOG_TAG_SIZE];
+	char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+/* A single producer, single consumer queue of messages. Each thread that
+ * prints gets its own, so printing never takes a lock. The log thread is
+ * the only consumer of all of them.
+ */
+typedef struct log_ring_St log_ring_t;
+
+struct log_ring_St {
+	log_entry_t entries[LOG_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+
+	/* Set while a thread owns the ring */
+	atomic_bool in_use;
+	char tag[LOG_TAG_SIZE];
+
+	log_ring_t *next;
+};
+
 static int verbosity_level = 1;
 
+static _Atomic (log_ring_t *) rings = NULL;
+static __thread log_ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+
+static pthread_t log_thread;
+static atomic_bool log_running = false;
+static atomic_bool log_stop = false;
+
 /* Returns the column width of the terminal
  * Borrowed from archlinux's pacman code
  */
@@ -57,6 +111,242 @@ column_width ()
 	}
 }
 
+/* Gives the ring back when its thread exits, the log thread will still
+ * print what is left in it.
+ */
+static void
+ring_release (void *arg)
+{
+	log_ring_t *ring = arg;
+
+	atomic_store (&ring->in_use, false);
+}
+
+/* Returns the ring of the calling thread. A ring left by a thread that has
+ * exited is reused if it has been drained, otherwise a new one is added.
+ */
+static log_ring_t *
+ring_get ()
+{
+	log_ring_t *ring;
+
+	if (thread_ring != NULL)
+		return thread_ring;
+
+	for (ring = atomic_load (&rings); ring != NULL; ring = ring->next) {
+		bool expected = false;
+
+		if (atomic_load (&ring->head) == atomic_load (&ring->tail) &&
+		    atomic_compare_exchange_strong (&ring->in_use, &expected, true))
+			break;
+	}
+
+	if (ring == NULL) {
+		ring = calloc (1, sizeof (log_ring_t));
+		atomic_init (&ring->head, 0);
+		atomic_init (&ring->tail, 0);
+		atomic_init (&ring->in_use, true);
+
+		ring->next = atomic_load (&rings);
+		while (!atomic_compare_exchange_weak (&rings, &ring->next, ring));
+	}
+
+	ring->tag[0] = '\0';
+	thread_ring = ring;
+	pthread_setspecific (ring_key, ring);
+
+	return ring;
+}
+
+/* Writes a message to the terminal */
+static void
+log_output (log_entry_t *entry)
+{
+	static bool progress_shown = false;
+	FILE *out = entry->kind == LOG_ERROR ? stderr : stdout;
+	const char *msg = entry->msg;
+
+	if (entry->kind == LOG_PROGRESS) {
+		fputs (entry->msg, stdout);
+		fflush (stdout);
+		progress_shown = true;
+		return;
+	}
+
+	/* Don't write over the progress bar */
+	if (progress_shown && msg[0] != '\n') {
+		putchar ('\n');
+		fflush (stdout);
+	}
+	progress_shown = false;
+
+	/* Leading newlines go before the timestamp */
+	for (; *msg == '\n'; msg++)
+		fputc ('\n', out);
+
+	if (verbosity_level >= 2) {
+		struct tm tm;
+
+		localtime_r (&entry->time.tv_sec, &tm);
+		fprintf (out, "[%02i:%02i:%02i.%03li] ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+				entry->time.tv_nsec / 1000000);
+
+		if (entry->tag[0] != '\0')
+			fprintf (out, "[%s] ", entry->tag);
+	}
+
+	if (entry->kind == LOG_ERROR)
+		fputs ("ERROR: ", out);
+
+	fputs (msg, out);
+	fflush (out);
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+	const struct timespec *ta = &((const log_entry_t *)a)->time;
+	const struct timespec *tb = &((const log_entry_t *)b)->time;
+
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec ? -1 : 1;
+
+	return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+/* Prints all queued messages in the order they were made.
+ * Returns false if there were none.
+ */
+static bool
+log_drain ()
+{
+	static log_entry_t *entries = NULL;
+	static size_t entries_size = 0;
+	size_t count = 0;
+
+	for (log_ring_t *ring = atomic_load (&rings); ring != NULL; ring = ring->next) {
+		unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit (&ring->head, memory_order_acquire);
+
+		for (; tail != head; tail++) {
+			if (count == entries_size) {
+				entries_size = entries_size ? entries_size * 2 : LOG_RING_SIZE;
+				entries = realloc (entries, entries_size * sizeof (log_entry_t));
+			}
+
+			entries[count++] = ring->entries[tail & (LOG_RING_SIZE - 1)];
+		}
+
+		atomic_store_explicit (&ring->tail, tail, memory_order_release);
+	}
+
+	qsort (entries, count, sizeof (log_entry_t), compare_entries);
+
+	for (size_t i = 0; i < count; i++)
+		log_output (entries + i);
+
+	return count > 0;
+}
+
+static void *
+log_thread_main (void *arg)
+{
+	struct timespec interval = { 0, LOG_POLL_INTERVAL * 1000000L };
+
+	while (!atomic_load (&log_stop)) {
+		if (!log_drain ())
+			nanosleep (&interval, NULL);
+	}
+
+	/* Print what was queued before print_shutdown */
+	log_drain ();
+
+	return NULL;
+}
+
+/* Starts the thread that prints the messages. Until this is called, and
+ * after print_shutdown, messages are printed directly.
+ */
+void
+print_init ()
+{
+	pthread_key_create (&ring_key, ring_release);
+
+	atomic_store (&log_stop, false);
+	pthread_create (&log_thread, NULL, log_thread_main, NULL);
+	atomic_store (&log_running, true);
+}
+
+/* Prints all queued messages and stops the log thread */
+void
+print_shutdown ()
+{
+	if (!atomic_load (&log_running))
+		return;
+
+	atomic_store (&log_stop, true);
+	pthread_join (log_thread, NULL);
+	atomic_store (&log_running, false);
+}
+
+/* Sets a tag that is shown in front of the messages from this thread in
+ * verbose mode.
+ */
+void
+print_set_tag (const char *fmt, ...)
+{
+	log_ring_t *ring = ring_get ();
+	va_list ap;
+
+	va_start (ap, fmt);
+	vsnprintf (ring->tag, LOG_TAG_SIZE, fmt, ap);
+	va_end (ap);
+}
+
+/* Queues a message for the log thread, or prints it if there is none */
+static void
+log_message (log_kind_t kind, const char *fmt, va_list ap)
+{
+	log_ring_t *ring;
+	log_entry_t *entry, direct;
+	unsigned int head;
+
+	if (!atomic_load (&log_running)) {
+		entry = &direct;
+		entry->tag[0] = '\0';
+	} else {
+		ring = ring_get ();
+		head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+		/* Wait for the log thread if the ring is full */
+		while (head - atomic_load_explicit (&ring->tail, memory_order_acquire) >= LOG_RING_SIZE)
+			sched_yield ();
+
+		entry = ring->entries + (head & (LOG_RING_SIZE - 1));
+		memcpy (entry->tag, ring->tag, LOG_TAG_SIZE);
+	}
+
+	clock_gettime (CLOCK_REALTIME, &entry->time);
+	entry->kind = kind;
+	vsnprintf (entry->msg, LOG_MSG_SIZE, fmt, ap);
+
+	if (entry == &direct) {
+		log_output (entry);
+	} else {
+		atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+	}
+}
+
+static void
+log_printf (log_kind_t kind, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start (ap, fmt);
+	log_message (kind, fmt, ap);
+	va_end (ap);
+}
+
 void
 print_set_verbosity_level (int level)
 {
@@ -72,7 +362,7 @@ print_info (int level, const char *fmt, ...)
 		return;
 
 	va_start (ap, fmt);
-	vprintf (fmt, ap);
+	log_message (LOG_INFO, fmt, ap);
 	va_end (ap);
 }
 
@@ -82,23 +372,24 @@ print_error (const char *fmt, ...)
 	va_list ap;
 
 	va_start (ap, fmt);
-	fprintf (stderr, "ERROR: ");
-	vfprintf (stderr, fmt, ap);
+	log_message (LOG_ERROR, fmt, ap);
 	va_end (ap);
 }
 
-/* Prints a byte count with the correct unit (B, KiB, MiB, GiB). */
-static void
-print_bytes (uint64_t bytes)
+/* Prints a byte count with the correct unit (B, KiB, MiB, GiB) to buf.
+ * Returns the number of characters printed.
+ */
+static int
+print_bytes (char *buf, size_t size, uint64_t bytes)
 {
 	if (bytes >= 2L * 1024 * 1024 * 1024) {
-		printf ("%#6.1fGiB", ((double)bytes) / (1024.0 * 1024.0 * 1024.0));
+		return snprintf (buf, size, "%#6.1fGiB", ((double)bytes) / (1024.0 * 1024.0 * 1024.0));
 	} else if (bytes >= 2L * 1024 * 1024) {
-		printf ("%#6.1fMiB", ((double)bytes) / (1024.0 * 1024.0));
+		return snprintf (buf, size, "%#6.1fMiB", ((double)bytes) / (1024.0 * 1024.0));
 	} else if (bytes >= 2L * 1024) {
-		printf ("%#6.1fKiB", ((double)bytes) / (1024.0));
+		return snprintf (buf, size, "%#6.1fKiB", ((double)bytes) / (1024.0));
 	} else {
-		printf ("%#6.1f  B", ((double)bytes));
+		return snprintf (buf, size, "%#6.1f  B", ((double)bytes));
 	}
 }
 
@@ -159,38 +450,45 @@ print_progress (const char *title, uint64_t cur_pos, uint64_t total_size)
 {
 	int progress = cur_pos * 100 / total_size;
 	int bar_size = column_width ();
+	char line[LOG_MSG_SIZE];
+	size_t len = 0;
 	uint64_t speed;
 
 	if (!calculate_avg_speed (cur_pos, &speed) && progress < 100)
 		return;
 
+	/* Leave room for the title and the terminating zero */
+	if (bar_size > LOG_MSG_SIZE - 64)
+		bar_size = LOG_MSG_SIZE - 64;
+
 	/* Print the title */
-	printf ("\r%s  ", title);
-	bar_size -= strlen (title) + 2;
+	len += snprintf (line + len, sizeof (line) - len, "\r%.200s  ", title);
+	bar_size -= (strlen (title) < 200 ? strlen (title) : 200) + 2;
 
 	/* If there is room, make some space */
-	while (bar_size > 100) {
-		printf (" ");
+	while (bar_size > 100 && len < sizeof (line) - 1) {
+		line[len++] = ' ';
 		bar_size--;
 	}
 
 	/* Print number of bytes received and avg speed (23 characters) */
-	print_bytes (cur_pos);
-	printf (" ");
-	print_bytes (speed);
-	printf ("/s [");
+	len += print_bytes (line + len, sizeof (line) - len, cur_pos);
+	len += snprintf (line + len, sizeof (line) - len, " ");
+	len += print_bytes (line + len, sizeof (line) - len, speed);
+	len += snprintf (line + len, sizeof (line) - len, "/s [");
 
 	/* Print the progress bar */
 	bar_size -= 23 + 7;
-	for (int i = 0; i < bar_size; i++) {
+	for (int i = 0; i < bar_size && len < sizeof (line) - 1; i++) {
 		if ((i * 100 / bar_size) < progress) {
-			printf ("#");
+			line[len++] = '#';
 		} else {
-			printf ("-");
+			line[len++] = '-';
 		}
 	}
 
 	/* Print the progress in percent (7 characters) */
-	printf ("] %3i %%", progress);
-	fflush (stdout);
+	snprintf (line + len, sizeof (line) - len, "] %3i %%", progress);
+
+	log_printf (LOG_PROGRESS, "%s", line);
 }
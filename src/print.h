@@ -22,6 +22,9 @@
 
 #include <stdint.h>
 
+void print_init (void);
+void print_shutdown (void);
+void print_set_tag (const char *fmt, ...);
 void print_set_verbosity_level (int level);
 void print_info (int level, const char *fmt, ...);
 void print_error (const char *fmt, ...);